@@ -61,6 +61,32 @@ public:
                    EXE_END);
   }
 
+  // Classifies 'cvs -n up' output as it arrives
+  class StatusSink: public LineSink {
+  public:
+    set<string> modified, added, removed, conflicted;
+
+    void line(const string &l) {
+      if(l.size() < 2)
+        return;
+      switch(l[0]) {
+      case 'M':
+        modified.insert(l.substr(2));
+        break;
+      case 'A':
+        added.insert(l.substr(2));
+        break;
+      case 'R':
+        removed.insert(l.substr(2));
+        break;
+      case 'C':
+        conflicted.insert(l.substr(2));
+        modified.insert(l.substr(2));
+        break;
+      }
+    }
+  };
+
   static void limit_set(set<string> &s, const set<string> &limit) {
     set<string>::iterator it = s.begin();
     while(it != s.end()) {
@@ -71,6 +97,26 @@ public:
     }
   }
 
+  // Add a job to BATCH for each directory in FILES, running 'cvs COMMAND
+  // [OPTION]' there on the files in that directory.  CVS keeps its state per
+  // directory, so only commands in different directories can safely run at
+  // once.
+  static void per_directory(vector<Job> &batch, const set<string> &files,
+                            const char *command, const char *option = NULL) {
+    map<string,vector<string> > dirs;
+    for(set<string>::const_iterator it = files.begin(); it != files.end();
+        ++it)
+      dirs[dirname_(*it)].push_back(basename_(*it));
+    for(map<string,vector<string> >::const_iterator it = dirs.begin();
+        it != dirs.end(); ++it)
+      add_job(batch, it->first, "cvs",
+              EXE_STR, command,
+              EXE_IFSTR(option, option),
+              EXE_STR, "--",
+              EXE_VECTOR, &it->second,
+              EXE_END);
+  }
+
   int revert(const vector<string> &files) const {
     // Reverting is a bit ugly in CVS.  We can 'cvs up -C' files that have just
     // been edited.  For added files we must use 'cvs rm -f'.  For deleted files
@@ -82,27 +128,12 @@ public:
 
 
     // Establish the current state
-    vector<string> status;
-    set<string> modified, added, removed, conflicted;
+    vector<string> command;
+    StatusSink status;
+    set<string> &modified = status.modified, &added = status.added,
+      &removed = status.removed, &conflicted = status.conflicted;
     int rc;
-    rc = capture(status, "cvs", "-n", "up", (char *)0);
-    for(size_t n = 0; n < status.size(); ++n) {
-      switch(status[n][0]) {
-      case 'M':
-        modified.insert(status[n].substr(2));
-        break;
-      case 'A':
-        added.insert(status[n].substr(2));
-        break;
-      case 'R':
-        removed.insert(status[n].substr(2));
-        break;
-      case 'C':
-        conflicted.insert(status[n].substr(2));
-        modified.insert(status[n].substr(2));
-        break;
-      }
-    }
+    rc = execute(makevs(command, "cvs", "-n", "up", (char *)0), status);
     // 'cvs -n up' exits with status 1 if there are conflicts or if something is
     // wrong.  So we wait to see if there are conflicts before deciding it was
     // reporting an error.  About the best we can do.
@@ -118,10 +149,10 @@ public:
       limit_set(added, limit);
       limit_set(removed, limit);
     }
-    // Currently we issue single commands for everything.  (And note that we
-    // invoke rm, rather than deleting directly, as a convenient way of including
-    // that step in the dry-run/verbose rules.)  This is simpler to implement but
-    // also guarantees that we don't run afoul of command-line length limits.
+    // Modified and removed files are handled with one command per directory,
+    // different directories in parallel.  (And note that we invoke rm, rather
+    // than deleting directly, as a convenient way of including that step in
+    // the dry-run/verbose rules.)
     //
     // Revert modified and conflicted files
     for(set<string>::iterator it = modified.begin();
@@ -134,24 +165,16 @@ public:
                    EXE_STRING, &*it,
                    EXE_END))
           return 1;
-      if(execute("cvs",
-                 EXE_STR, "up",
-                 EXE_STR, "-C",
-                 EXE_STR, "--",
-                 EXE_STRING, &*it,
-                 EXE_END))
-        return 1;
     }
+    vector<Job> batch;
+    per_directory(batch, modified, "up", "-C");
+    if(execute_many(batch))
+      return 1;
     // Re-add removed files
-    for(set<string>::iterator it = removed.begin();
-        it != removed.end();
-        ++it)
-      if(execute("cvs",
-                 EXE_STR, "add",
-                 EXE_STR, "--",
-                 EXE_STRING, &*it,
-                 EXE_END))
-        return 1;
+    batch.clear();
+    per_directory(batch, removed, "add");
+    if(execute_many(batch))
+      return 1;
     // Remove added files
     for(set<string>::iterator it = added.begin();
         it != added.end();
@@ -18,35 +18,40 @@
 #include "vcs.h"
 #include "svnutils.h"
 #include "p4utils.h"
+#include "reactor.h"
 #include <sys/wait.h>
+#include <spawn.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <climits>
 #include <cerrno>
 
+extern char **environ;
+
+// Largest single read from a child, and the pipe size asked for when a lot
+// of output is expected
+static const size_t max_read = 1 << 20;
+
 // Base class for things that can be attached to the event loop
 class monitor {
 public:
   virtual ~monitor() {
   }
 
-  // Called inside the fork
-  virtual void insidefork() = 0;
-
-  // Calle after the fork
-  virtual void afterfork() = 0;
+  // Called to add what the child needs to FILE_ACTIONS
+  virtual void spawnactions(posix_spawn_file_actions_t *file_actions) = 0;
 
-  // Called before select()
-  virtual void beforeselect(fd_set *rfds, fd_set *wfds, int &max) = 0;
-
-  // Called after select()
-  virtual void afterselect(fd_set *rfds, fd_set *wfds) = 0;
+  // Called after the child has been started
+  virtual void afterspawn() = 0;
 
   // Test whether this monitor is still active
   virtual bool active() = 0;
 };
 
-// FD-based things that can be attached to the event loop
-class fdmonitor: public monitor {
+// FD-based things that can be attached to the event loop.  Once watched, the
+// FD is serviced whenever anything waits for the reactor.
+class fdmonitor: public monitor, public EventHandler {
 public:
   inline fdmonitor():
     fd(-1) {
@@ -57,22 +62,22 @@ public:
   }
 
   virtual ~fdmonitor() {
-    if(fd != -1)
+    if(fd != -1) {
+      Reactor::instance().remove(fd);
       ::close(fd);
+    }
   }
 protected:
   int fd;
 
-  void update_fd_set(fd_set *fds, int &max) {
-    if(fd != -1) {
-      FD_SET(fd, fds);
-      if(fd > max)
-        max = fd;
-    }
+  // Start watching FD for EVENTS
+  void watch(unsigned events) {
+    Reactor::instance().add(fd, events, this);
   }
 
   void close() {
     if(fd != -1) {
+      Reactor::instance().remove(fd);
       if(::close(fd) < 0)
         fatal("error calling close: %s", strerror(errno));
       fd = -1;
@@ -85,42 +90,55 @@ class fdredirect: public fdmonitor {
 public:
   inline fdredirect():
     parentfd(-1),
-    childfd(-1) {
+    childfd(-1),
+    events(0) {
   }
 protected:
   int parentfd;                         // opened FD child will read/write
   int childfd;                          // target FD in child
+  unsigned events;                      // what to watch fd for
 
   // Called if the parent process will write (to the configured FD) and the
   // child read (from childid).
   void writer(int childid) {
     make_pipe(parentfd/*read end of pipe*/, fd/*write end of pipe*/);
     childfd = childid;
+    events = Reactor::Write;
   }
 
   // Called if the parent process will read (from the configured FD) and the
-  // child write (to childid).
-  void reader(int childid) {
+  // child write (to childid).  If BIG is true then a lot of output is
+  // expected.
+  void reader(int childid, bool big = false) {
     make_pipe(fd/*read end of pipe*/, parentfd/*write end of pipe*/);
     childfd = childid;
+    events = Reactor::Read;
+#ifdef F_SETPIPE_SZ
+    // A bigger pipe means fewer wakeups on both sides.  The system may
+    // refuse, which is harmless.  (Every pipe counts against a per-user
+    // limit, so this isn't done for all of them.)
+    if(big)
+      fcntl(fd, F_SETPIPE_SZ, (int)max_read);
+#else
+    (void)big;
+#endif
   }
 
 private:
-  void insidefork() {
-    if(dup2(parentfd, childfd) < 0) {
-      perror("dup2");
-      _exit(1);
-    }
-    // Close both original pipe FDs
-    if(::close(parentfd) < 0 || ::close(fd) < 0) {
-      perror("close");
-      _exit(1);
-    }
+  void spawnactions(posix_spawn_file_actions_t *file_actions) {
+    // Both original pipe FDs are close-on-exec, so only the copy survives
+    int rc;
+    if((rc = posix_spawn_file_actions_adddup2(file_actions, parentfd,
+                                              childfd)))
+      fatal("error calling posix_spawn_file_actions_adddup2: %s",
+            strerror(rc));
   }
 
-  void afterfork() {
+  void afterspawn() {
     if(::close(parentfd) < 0)
       fatal("error calling close: %s", strerror(errno));
+    parentfd = -1;
+    watch(events);
   }
 
   void make_pipe(int &rfd, int &wfd) {
@@ -128,8 +146,18 @@ private:
 
     if(pipe(p) < 0)
       fatal("error creating pipe: %s", strerror(errno));
+    // Neither end should leak into unrelated subprocesses.  (dup2() clears
+    // the flag for the child's copy.)
+    if(fcntl(p[0], F_SETFD, FD_CLOEXEC) < 0
+       || fcntl(p[1], F_SETFD, FD_CLOEXEC) < 0)
+      fatal("error calling fcntl: %s", strerror(errno));
     rfd = p[0];
     wfd = p[1];
+    // Our end must not block, or a child stuck writing output we aren't
+    // reading could never read the rest of its input
+    const int flags = fcntl(fd, F_GETFL);
+    if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+      fatal("error calling fcntl: %s", strerror(errno));
   }
 };
 
@@ -140,84 +168,164 @@ public:
     writer(childid);
   }
 
-  void beforeselect(fd_set *, fd_set *wfds, int &max) {
-    update_fd_set(wfds, max);
-  }
-
-  void afterselect(fd_set *, fd_set *wfds) {
-    if(fd >= 0 && FD_ISSET(fd, wfds)) {
-      size_t nbytes = 0;
-      const void *ptr = available(nbytes);
-      if(nbytes) {
-        const int written = write(fd, ptr, nbytes);
+  void ready() {
+    struct iovec iov[max_iov];
+    const size_t niov = available(iov, max_iov);
+    if(niov) {
+      const ssize_t written = writev(fd, iov, niov);
 
-        if(written < 0)
-          fatal("write error: %s", strerror(errno));
-        wrote(written);
-      } else
-        close();
-    }
+      if(written < 0) {
+        if(errno == EAGAIN || errno == EINTR)
+          return;
+        fatal("write error: %s", strerror(errno));
+      }
+      wrote(written);
+    } else
+      close();
   }
 
-  // Find out what to write next
-  virtual const void *available(size_t &nbytes) = 0;
+  // Describe what to write next in up to MAXIOV entries of IOV and return
+  // the number used, or 0 if there's nothing left
+  virtual size_t available(struct iovec *iov, size_t maxiov) = 0;
 
   // Called when NBYTES have been written
   virtual void wrote(size_t nbytes) = 0;
+
+private:
+  // Enough for a pipe's worth of short lines in one call
+#ifdef IOV_MAX
+  static const size_t max_iov = IOV_MAX < 1024 ? IOV_MAX : 1024;
+#else
+  static const size_t max_iov = 16;
+#endif
 };
 
-// Write a string to child's redirected FD
-class writefromstring: public writetofd {
+// Write lines to a child's redirected FD, each followed by a newline.  The
+// lines are written directly from the caller's vector, which must remain
+// valid until the child's input is closed.
+class writefromlines: public writetofd {
 public:
-  writefromstring():
-    written(0) {
+  writefromlines():
+    lines(NULL),
+    line(0),
+    offset(0) {
   }
 
-  void init(const string &s_, int childid = 0) {
-    s = s_;
+  void init(const vector<string> &lines_, int childid = 0) {
+    lines = &lines_;
     writetofd::init(childid);
   }
+
 private:
-  // string to write
-  string s;
+  const vector<string> *lines;          // lines to write
+  size_t line;                          // next line to write
+  size_t offset;                        // bytes of it already written
+
+  size_t available(struct iovec *iov, size_t maxiov) {
+    // Every line shares the same newline
+    static const char newline[] = "\n";
+    size_t n = 0, skip = offset;
+    for(size_t l = line; l < lines->size() && n + 2 <= maxiov; ++l) {
+      const string &s = (*lines)[l];
+      if(skip < s.size()) {
+        iov[n].iov_base = (void *)(s.data() + skip);
+        iov[n++].iov_len = s.size() - skip;
+      }
+      iov[n].iov_base = (void *)newline;
+      iov[n++].iov_len = 1;
+      skip = 0;
+    }
+    return n;
+  }
 
-  // bytes written so far
-  size_t written;
+  void wrote(size_t nbytes) {
+    while(nbytes) {
+      const size_t left = (*lines)[line].size() + 1 - offset;
+      if(nbytes < left) {
+        offset += nbytes;
+        break;
+      }
+      nbytes -= left;
+      ++line;
+      offset = 0;
+    }
+  }
+};
 
-  const void *available(size_t &nbytes) {
-    nbytes = s.size() - written;
-    return s.data() + written;
+// Write lines from a LineSource to a child's redirected FD.  Lines are
+// fetched in batches as the child consumes them.
+class writefromsource: public writetofd {
+public:
+  writefromsource(LineSource &source_):
+    source(source_),
+    written(0),
+    finished(false) {
+  }
+
+  void init(int childid = 0) {
+    writetofd::init(childid);
+  }
+
+private:
+  LineSource &source;
+  string pending;                       // batch being written
+  size_t written;                       // bytes of pending written
+  bool finished;                        // true when source is exhausted
+  string l;
+
+  size_t available(struct iovec *iov, size_t) {
+    if(written == pending.size()) {
+      pending.clear();
+      written = 0;
+      while(!finished && pending.size() < batch) {
+        if(source.next(l)) {
+          pending += l;
+          pending += '\n';
+        } else
+          finished = true;
+      }
+      if(!pending.size())
+        return 0;
+    }
+    iov[0].iov_base = (void *)(pending.data() + written);
+    iov[0].iov_len = pending.size() - written;
+    return 1;
   }
 
   void wrote(size_t nbytes) {
     written += nbytes;
   }
+
+  static const size_t batch = 65536;
 };
 
 // Read from an FD
 class readfromfd: public fdredirect {
 public:
-  void init(int childid = 0) {
-    reader(childid);
+  readfromfd(): want(4096) {
   }
 
-  void beforeselect(fd_set *rfds, fd_set *, int &max) {
-    update_fd_set(rfds, max);
+  void init(int childid = 0, bool big = false) {
+    reader(childid, big);
   }
 
-  void afterselect(fd_set *rfds, fd_set *) {
-    if(fd >= 0 && FD_ISSET(fd, rfds)) {
-      char buffer[4096];
-      int n = ::read(fd, buffer, sizeof buffer);
+  void ready() {
+    readsome();
+  }
 
-      if(n < 0)
-        fatal("read error: %s", strerror(errno));
-      if(n == 0) {
-        close();
-        eof();
-      } else
-        read(buffer, n);
-    }
+  // Read whatever is already waiting, without blocking
+  void drain() {
+    while(fd != -1 && readsome())
+      ;
+  }
+
+  // Return somewhere to read at least N bytes, setting N to the space
+  // available
+  virtual char *space(size_t &n) {
+    if(buffer.size() < n)
+      buffer.resize(n);
+    n = buffer.size();
+    return &buffer[0];
   }
 
   // Called when bytes have been read
@@ -227,6 +335,36 @@ public:
   virtual void eof() {
     // Default does nothing
   }
+
+private:
+  size_t want;                          // how much to try to read
+  vector<char> buffer;                  // default space to read into
+
+  // Read once.  Return true if there might be more to read.
+  bool readsome() {
+    size_t avail = want;
+    char *const ptr = space(avail);
+    const ssize_t n = ::read(fd, ptr, avail);
+
+    if(n < 0) {
+      if(errno == EINTR)
+        return true;
+      if(errno == EAGAIN)
+        return false;
+      fatal("read error: %s", strerror(errno));
+    }
+    if(n == 0) {
+      close();
+      eof();
+      return false;
+    }
+    // Filling the space suggests there's more waiting, so ask for more next
+    // time
+    if((size_t)n == avail && want < max_read)
+      want *= 2;
+    read(ptr, n);
+    return true;
+  }
 };
 
 // Read from a child's redirected FD into a sintrg
@@ -248,6 +386,108 @@ private:
   }
 };
 
+// Read from a child's redirected FD and pass it on a line at a time
+class readtolines: public readfromfd {
+public:
+  readtolines(LineSink &sink_, bool strip_):
+    sink(sink_),
+    strip(strip_) {
+  }
+
+  void init(int childid = 1, bool big = false) {
+    readfromfd::init(childid, big);
+  }
+
+private:
+  LineSink &sink;
+  bool strip;
+  string partial;
+
+  void read(void *ptr, size_t nbytes) {
+    const char *p = (const char *)ptr, *const end = p + nbytes;
+    while(p < end) {
+      const char *nl = (const char *)memchr(p, '\n', end - p);
+      if(!nl) {
+        partial.append(p, end);
+        break;
+      }
+      partial.append(p, nl + !strip);
+      sink.line(partial);
+      partial.clear();
+      p = nl + 1;
+    }
+  }
+
+  void eof() {
+    if(partial.size()) {
+      sink.line(partial);
+      partial.clear();
+    }
+  }
+};
+
+// Collect lines into a vector
+class appendlines: public LineSink {
+public:
+  appendlines(vector<string> &lines_): lines(lines_) {
+    lines.clear();
+  }
+
+private:
+  vector<string> &lines;
+
+  void line(const string &l) {
+    lines.push_back(l);
+  }
+};
+
+// Read from a child's redirected FD straight into a LineBuffer
+class readtobuffer: public readfromfd {
+public:
+  readtobuffer(LineBuffer &lb_): lb(lb_) {
+  }
+
+  void init(int childid = 1) {
+    readfromfd::init(childid, true);
+  }
+
+private:
+  LineBuffer &lb;
+
+  char *space(size_t &n) {
+    return lb.space(n);
+  }
+
+  void read(void *, size_t nbytes) {
+    lb.commit(nbytes);
+  }
+};
+
+// Read from a child's redirected FD and pass it on as it arrives.  If BEFORE
+// is not NULL then whatever the child has already written to it is read
+// first, so that anything written there ahead of a block is seen ahead of it.
+class readtochunks: public readfromfd {
+public:
+  readtochunks(ChunkSink &sink_, readfromfd *before_ = NULL):
+    sink(sink_),
+    before(before_) {
+  }
+
+  void init(int childid = 1) {
+    readfromfd::init(childid, true);
+  }
+
+private:
+  ChunkSink &sink;
+  readfromfd *before;
+
+  void read(void *ptr, size_t nbytes) {
+    if(before)
+      before->drain();
+    sink.chunk((const char *)ptr, nbytes);
+  }
+};
+
 static string shellquote(const string &s) {
   bool quote;
 
@@ -275,15 +515,52 @@ void display_command(const vector<string> &vs) {
   fputc('\n',  stderr);
 }
 
-// General purpose command execution
-static int exec(const vector<string> &args,
-                const list<monitor *> &monitors,
-                unsigned killfds = 0,
-                const char *output = 0) {
+// Notice when a child exits, if the platform can tell us through a file
+// descriptor.  Otherwise it is never active and the child is waited for in
+// the usual way.
+class childmonitor: public fdmonitor {
+public:
+  childmonitor(pid_t pid_): pid(pid_), status(0), exited(false) {
+    if(pid > 0 && (fd = pid_fd(pid)) >= 0)
+      watch(Reactor::Read);
+  }
+
+  pid_t pid;
+  int status;                           // wait status if exited
+  bool exited;                          // true if reaped
+
+private:
+  void spawnactions(posix_spawn_file_actions_t *) {
+  }
+
+  void afterspawn() {
+  }
+
+  void ready() {
+    pid_t rc;
+    while((rc = waitpid(pid, &status, WNOHANG)) < 0 && errno == EINTR)
+      ;
+    if(rc < 0)
+      fatal("error calling waitpid: %s", strerror(errno));
+    if(rc == pid) {
+      exited = true;
+      close();
+    }
+  }
+};
+
+// Start a subprocess and return its process ID, or 0 if it could not be
+// executed (having said why).  posix_spawn() doesn't copy the parent's
+// address space, so this costs the same however big we have grown.
+static pid_t spawn(const vector<string> &args,
+                   const list<monitor *> &monitors,
+                   unsigned killfds = 0,
+                   const char *output = 0) {
   pid_t pid;
   list<monitor *>::const_iterator it;
   vector<const char *> cargs;
-  int outfd;
+  int outfd, rc;
+  posix_spawn_file_actions_t file_actions;
 
   // Convert args to C format
   cargs.reserve(args.size());
@@ -299,92 +576,98 @@ static int exec(const vector<string> &args,
     outfd = open(output, O_WRONLY|O_TRUNC|O_CREAT, 0666);
     if(outfd < 0)
       fatal("error opening %s: %s", output, strerror(errno));
+    if(fcntl(outfd, F_SETFD, FD_CLOEXEC) < 0)
+      fatal("error calling fcntl: %s", strerror(errno));
   } else
     outfd = -1;
+  // Describe what the child's file descriptors should be
+  if((rc = posix_spawn_file_actions_init(&file_actions)))
+    fatal("error calling posix_spawn_file_actions_init: %s", strerror(rc));
+  for(it = monitors.begin();
+      it != monitors.end();
+      ++it)
+    (*it)->spawnactions(&file_actions);
+  for(int n = 0; n < 3; ++n)
+    if((killfds & (1 << n))
+       && (rc = posix_spawn_file_actions_addopen(&file_actions, n,
+                                                 "/dev/null", O_RDWR, 0)))
+      fatal("error calling posix_spawn_file_actions_addopen: %s",
+            strerror(rc));
+  if(outfd != -1
+     && (rc = posix_spawn_file_actions_adddup2(&file_actions, outfd, 1)))
+    fatal("error calling posix_spawn_file_actions_adddup2: %s",
+          strerror(rc));
   // Start subprocess
-  if((pid = fork()) < 0)
-    fatal("error calling fork: %s", strerror(errno));
-  if(pid == 0) {
-    for(it = monitors.begin();
-        it != monitors.end();
-        ++it)
-      (*it)->insidefork();
-    if(killfds) {
-      const int nullfd = open("/dev/null", O_RDWR);
-      if(nullfd < 0) {
-        perror("/dev/null");
-        _exit(-1);
-      }
-      for(int n = 0; n < 3; ++n)
-        if((killfds & (1 << n)) && dup2(nullfd, n) < 0) {
-          perror("dup2");
-          _exit(-1);
-        }
-      if(close(nullfd) < 0) {
-        perror("close");
-        _exit(-1);
-      }
-    }
-    if(outfd != -1) {
-      if(dup2(outfd, 1) < 0) {
-        perror("dup2");
-        _exit(-1);
-      }
-      if(close(outfd) < 0) {
-        perror("close");
-        _exit(-1);
-      }
-    }
-    execvp(cargs[0], (char **)&cargs[0]);
-    fprintf(stderr, "executing %s: %s\n", cargs[0], strerror(errno));
-    _exit(1);
+  rc = posix_spawnp(&pid, cargs[0], &file_actions, NULL,
+                    (char **)&cargs[0], environ);
+  posix_spawn_file_actions_destroy(&file_actions);
+  if(rc) {
+    fprintf(stderr, "executing %s: %s\n", cargs[0], strerror(rc));
+    pid = 0;
   }
+  if(outfd != -1 && close(outfd) < 0)
+    fatal("error calling close: %s", strerror(errno));
   for(it = monitors.begin();
       it != monitors.end();
       ++it)
-    (*it)->afterfork();
-  /* Feed in input and gather output */
+    (*it)->afterspawn();
+  return pid;
+}
+
+// Feed in input and gather output until all of MONITORS are finished.
+// Everything else being watched (e.g. commands running in the background) is
+// serviced too but not waited for, so that a background command never stalls
+// on a full pipe while the foreground is busy.
+static void service(const list<monitor *> &monitors) {
   for(;;) {
-    // Give each active monitor a chance to fiddle with select() args
-    fd_set rfds[1], wfds[1];
-    FD_ZERO(rfds);
-    FD_ZERO(wfds);
-    int max = -1, nactive = 0;
-    for(it = monitors.begin();
-        it != monitors.end();
-        ++it) {
-      if((*it)->active()) {
-        ++nactive;
-        (*it)->beforeselect(rfds, wfds, max);
-      }
-    }
-    if(!nactive)
-      // Stop waiting for IO if no monitors left, the wait will never finish
+    list<monitor *>::const_iterator it = monitors.begin();
+    while(it != monitors.end() && !(*it)->active())
+      ++it;
+    if(it == monitors.end())
       break;
-    const int rc = select(max + 1, rfds, wfds, NULL, NULL);
+    Reactor::instance().wait();
+  }
+}
+
+// Wait for subprocess PID (running NAME) to terminate and return its exit
+// status.  If CHILD is not NULL it may already have collected the status.
+static int reap(pid_t pid, const char *name,
+                const childmonitor *child = NULL) {
+  int w;
+  pid_t rc;
+  if(!pid)
+    return 1;                           // spawn() failed
+  if(child && child->exited)
+    w = child->status;
+  else {
+    while((rc = waitpid(pid, &w, 0)) < 0
+          && errno == EINTR)
+      ;
     if(rc < 0)
-      fatal("error calling select: %s", strerror(errno));
-    for(it = monitors.begin();
-        it != monitors.end();
-        ++it) {
-      if((*it)->active())
-        (*it)->afterselect(rfds, wfds);
-    }
+      fatal("error calling waitpid: %s", strerror(errno));
   }
-  // Wait for subprocess to terminate
-  int w, rc;
-  while((rc = waitpid(pid, &w, 0) < 0)
-        && errno == EINTR)
-    ;
-  if(rc < 0)
-    fatal("error calling waitpid: %s", strerror(errno));
   // Signals are always fatal
   if(WIFSIGNALED(w))
-    fatal("%s received fatal signal %d (%s)", cargs[0],
+    fatal("%s received fatal signal %d (%s)", name,
           WTERMSIG(w), strsignal(WTERMSIG(w)));
   if(WIFEXITED(w))
     return WEXITSTATUS(w);
-  fatal("%s exited with unknown wait status %#x", cargs[0], w);
+  fatal("%s exited with unknown wait status %#x", name, w);
+}
+
+// General purpose command execution
+static int exec(const vector<string> &args,
+                const list<monitor *> &monitors,
+                unsigned killfds = 0,
+                const char *output = 0) {
+  const pid_t pid = spawn(args, monitors, killfds, output);
+  // Keep servicing other commands until this one has exited, not just until
+  // its output is closed
+  childmonitor child(pid);
+  list<monitor *> all = monitors;
+  all.push_back(&child);
+  service(all);
+  return reap(pid, args[0].c_str(), &child);
 }
 
 static string dotstuff(const string &s) {
@@ -406,7 +689,9 @@ static string identity(const string &s) {
 static void assemble(vector<string> &cmd,
                      const char *prog,
                      va_list ap,
-                     unsigned &killfds) {
+                     unsigned &killfds,
+                     vector<string> *input = NULL,
+                     bool *has_input = NULL) {
   cmd.push_back(prog);
   int op;
   while((op = va_arg(ap, int)) != EXE_END) {
@@ -459,6 +744,15 @@ static void assemble(vector<string> &cmd,
       }
       break;
     }
+    case EXE_INPUT: {
+      const vector<string> *ss = va_arg(ap, const vector<string> *);
+      assert(input);
+      *has_input = true;
+      for(vector<string>::const_iterator it = ss->begin(); it != ss->end();
+          ++it)
+        input->push_back(transform(*it));
+      break;
+    }
     case EXE_NO_STDOUT:
       killfds |= 1 << 1;
       break;
@@ -485,15 +779,6 @@ static void split(vector<string> &lines, const string &s, int stripNewlines = 1)
     lines.push_back(s.substr(pos, limit - pos));
 }
 
-// Join a string with newlines
-static void join(string &s, const vector<string> &lines) {
-  s.clear();
-  for(size_t n = 0; n < lines.size(); ++n) {
-    s.append(lines[n]);
-    s.append("\n");
-  }
-}
-
 static vector<string> &vmakevs(vector<string> &command,
                                const char *prog,
                                va_list ap) {
@@ -522,14 +807,25 @@ int execute(const char *prog, ...) {
   vector<string> cmd;
   unsigned killfds = 0;
 
+  vector<string> input;
+  bool has_input = false;
+  list<monitor *> monitors;
+  writefromlines w;
+
   va_start(ap, prog);
-  assemble(cmd, prog, ap, killfds);
+  assemble(cmd, prog, ap, killfds, &input, &has_input);
   va_end(ap);
-  if(dryrun || verbose)
+  if(dryrun || verbose) {
     display_command(cmd);
+    report_lines(input, NULL, "| ");
+  }
   if(dryrun)
     return 0;
-  return exec(cmd, list<monitor *>(), killfds);
+  if(has_input) {
+    w.init(input, 0);
+    monitors.push_back(&w);
+  }
+  return exec(cmd, monitors, killfds);
 }
 
 // Execute a command (specified like execl()) and capture its output.
@@ -593,19 +889,22 @@ int execute(const vector<string> &command,
             const char *outputPath,
             unsigned flags) {
   list<monitor *> monitors;
-  writefromstring w;
-  readtostring ro, re;
+  writefromlines w;
+  // Output is split into lines as it arrives, rather than being gathered
+  // into one string and copied again afterwards
+  vector<string> unused;
+  appendlines lines(output ? *output : unused);
+  readtolines ro(lines, !(flags & EXE_RAW));
+  readtostring re;
 
   if(input) {
-    string s;
-    join(s, *input);
-    w.init(s, 0);
+    w.init(*input, 0);
     monitors.push_back(&w);
     if(debug > 1)
       report_lines(*input, "Input", "| ");
   }
   if(output) {
-    ro.init(1);
+    ro.init(1, !!(flags & EXE_BIG));
     monitors.push_back(&ro);
   }
   if(errors) {
@@ -613,11 +912,57 @@ int execute(const vector<string> &command,
     monitors.push_back(&re);
   }
   const int rc = exec(command, monitors, 0, outputPath);
-  if(output) {
-    split(*output, ro.str(), !(flags & EXE_RAW));
+  if(output && debug > 1)
+    report_lines(*output, "Output", "| ");
+  if(errors) {
+    split(*errors, re.str());
+    if(debug > 1)
+      report_lines(*errors, "Errors", "| ");
+  }
+  return rc;
+}
+
+// Execution with output passed to SINK as it arrives
+int execute(const vector<string> &command,
+            LineSink &sink,
+            vector<string> *errors,
+            unsigned flags) {
+  list<monitor *> monitors;
+  readtolines ro(sink, !(flags & EXE_RAW));
+  readtostring re;
+
+  ro.init(1);
+  monitors.push_back(&ro);
+  if(errors) {
+    re.init(2);
+    monitors.push_back(&re);
+  }
+  const int rc = exec(command, monitors);
+  if(errors) {
+    split(*errors, re.str());
     if(debug > 1)
-      report_lines(*output, "Output", "| ");
+      report_lines(*errors, "Errors", "| ");
   }
+  return rc;
+}
+
+// Run COMMAND with W (if not NULL) feeding its input and RO reading its
+// output.  Errors are captured as by execute().
+static int execute_with(const vector<string> &command,
+                        writetofd *w,
+                        readfromfd &ro,
+                        vector<string> *errors) {
+  list<monitor *> monitors;
+  readtostring re;
+
+  if(w)
+    monitors.push_back(w);
+  monitors.push_back(&ro);
+  if(errors) {
+    re.init(2);
+    monitors.push_back(&re);
+  }
+  const int rc = exec(command, monitors);
   if(errors) {
     split(*errors, re.str());
     if(debug > 1)
@@ -626,6 +971,300 @@ int execute(const vector<string> &command,
   return rc;
 }
 
+// Execution with output captured in a LineBuffer
+static int capture_buffer(const vector<string> &command,
+                          writetofd *w,
+                          LineBuffer &output,
+                          vector<string> *errors) {
+  readtobuffer ro(output);
+
+  output.clear();
+  ro.init(1);
+  const int rc = execute_with(command, w, ro, errors);
+  output.finish();
+  if(debug > 1) {
+    fputs("Output:\n", stderr);
+    size_t pos = 0;
+    LineSpan l;
+    while(output.next(pos, l))
+      fprintf(stderr, "| %.*s\n", (int)l.len, l.ptr);
+  }
+  return rc;
+}
+
+int execute(const vector<string> &command,
+            const vector<string> *input,
+            LineBuffer &output,
+            vector<string> *errors) {
+  writefromlines w;
+
+  if(input) {
+    w.init(*input, 0);
+    if(debug > 1)
+      report_lines(*input, "Input", "| ");
+  }
+  return capture_buffer(command, input ? &w : NULL, output, errors);
+}
+
+int execute(const vector<string> &command,
+            LineSource &input,
+            LineBuffer &output,
+            vector<string> *errors) {
+  writefromsource w(input);
+
+  w.init(0);
+  return capture_buffer(command, &w, output, errors);
+}
+
+// Execution with output passed to SINK in blocks as it arrives
+int execute(const vector<string> &command,
+            const vector<string> *input,
+            ChunkSink &sink,
+            vector<string> *errors) {
+  writefromlines w;
+  readtochunks ro(sink);
+
+  if(input) {
+    w.init(*input, 0);
+    if(debug > 1)
+      report_lines(*input, "Input", "| ");
+  }
+  ro.init(1);
+  return execute_with(command, input ? &w : NULL, ro, errors);
+}
+
+int execute(const vector<string> &command,
+            LineSource &input,
+            ChunkSink &sink,
+            LineSink &errors) {
+  list<monitor *> monitors;
+  writefromsource w(input);
+  readtolines re(errors, true);
+  readtochunks ro(sink, &re);
+
+  w.init(0);
+  ro.init(1);
+  re.init(2);
+  monitors.push_back(&w);
+  monitors.push_back(&ro);
+  monitors.push_back(&re);
+  return exec(command, monitors);
+}
+
+// Job pool -------------------------------------------------------------------
+
+void add_job(vector<Job> &batch, const string &directory,
+             const char *prog, ...) {
+  va_list ap;
+  Job job;
+
+  va_start(ap, prog);
+  assemble(job.command, prog, ap, job.killfds);
+  va_end(ap);
+  job.directory = directory;
+  batch.push_back(job);
+}
+
+// Return how many commands to run at once
+static size_t concurrency() {
+  if(jobs > 0)
+    return jobs;
+  const char *env = getenv("VCS_JOBS");
+  if(env && atoi(env) > 0)
+    return atoi(env);
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus > 0 ? cpus : 1;
+}
+
+// A command from a batch that has been started
+struct RunningJob {
+  RunningJob(): pid(0), child(NULL) {
+    out.init(1);
+    err.init(2);
+  }
+
+  ~RunningJob() {
+    delete child;
+  }
+
+  pid_t pid;
+  readtostring out, err;
+  childmonitor *child;
+
+  bool finished() {
+    return !out.active() && !err.active() && !child->active();
+  }
+};
+
+// Write S to FP
+static void write_raw(FILE *fp, const char *what, const string &s) {
+  if(s.size() && fwrite(s.data(), 1, s.size(), fp) != s.size())
+    fatal("writing to %s: %s", what, strerror(errno));
+  if(fflush(fp) < 0)
+    fatal("writing to %s: %s", what, strerror(errno));
+}
+
+int execute_many(vector<Job> &batch, bool stop) {
+  const size_t limit = concurrency();
+  size_t n;
+  int rc = 0;
+
+  if(dryrun || limit == 1 || batch.size() < 2) {
+    // One at a time, with output passed straight through
+    for(n = 0; n < batch.size() && !(stop && rc); ++n) {
+      Job &job = batch[n];
+      InDirectory id(job.directory.size() ? job.directory : ".");
+      if(dryrun || verbose)
+        display_command(job.command);
+      if(dryrun)
+        job.status = 0;
+      else {
+        list<monitor *> monitors;
+        job.status = exec(job.command, monitors, job.killfds);
+      }
+      if(job.status && !rc)
+        rc = job.status;
+    }
+    return rc;
+  }
+  // Finished jobs' output is held back until all the jobs before them have
+  // finished
+  map<size_t, RunningJob *> running;
+  vector<pair<string,string> > held(batch.size());
+  size_t next_start = 0, next_output = 0;
+  bool failed = false;
+  while(next_output < next_start || (next_start < batch.size() && !failed)) {
+    // Start as many jobs as we are allowed
+    while(running.size() < limit && next_start < batch.size() && !failed) {
+      Job &job = batch[next_start];
+      InDirectory id(job.directory.size() ? job.directory : ".");
+      if(verbose)
+        display_command(job.command);
+      RunningJob *r = new RunningJob();
+      list<monitor *> monitors;
+      monitors.push_back(&r->out);
+      monitors.push_back(&r->err);
+      r->pid = spawn(job.command, monitors, job.killfds);
+      r->child = new childmonitor(r->pid);
+      running[next_start++] = r;
+    }
+    // Collect any jobs that have finished
+    bool progress = false;
+    for(map<size_t, RunningJob *>::iterator it = running.begin();
+        it != running.end();) {
+      RunningJob *r = it->second;
+      if(!r->finished()) {
+        ++it;
+        continue;
+      }
+      Job &job = batch[it->first];
+      job.status = reap(r->pid, job.command[0].c_str(), r->child);
+      if(job.status && stop)
+        failed = true;
+      held[it->first].first = r->out.str();
+      held[it->first].second = r->err.str();
+      delete r;
+      running.erase(it++);
+      progress = true;
+    }
+    // Pass on output in order
+    while(next_output < next_start && batch[next_output].status != -1) {
+      write_raw(stdout, "stdout", held[next_output].first);
+      write_raw(stderr, "stderr", held[next_output].second);
+      held[next_output] = pair<string,string>();
+      if(batch[next_output].status && !rc)
+        rc = batch[next_output].status;
+      ++next_output;
+    }
+    // Wait for something to happen
+    if(!progress && running.size())
+      Reactor::instance().wait();
+  }
+  return rc;
+}
+
+// AsyncCommand ---------------------------------------------------------------
+
+AsyncCommand::AsyncCommand(): pid(-1), sink(NULL), ro(NULL), re(NULL),
+                              wi(NULL) {
+}
+
+AsyncCommand::~AsyncCommand() {
+  if(pid != -1) {
+    // Abandoned without waiting; discard the output and collect the process,
+    // but don't throw from a destructor.
+    delete ro;
+    delete re;
+    delete wi;
+    while(pid > 0 && waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+      ;
+  }
+}
+
+void AsyncCommand::start(const vector<string> &command_,
+                         unsigned flags_,
+                         const vector<string> *input) {
+  start(command_, *this, flags_, input);
+}
+
+void AsyncCommand::start(const vector<string> &command_,
+                         LineSink &sink_,
+                         unsigned flags_,
+                         const vector<string> *input) {
+  assert(pid == -1);
+  command = command_;
+  flags = flags_;
+  sink = &sink_;
+  output.clear();
+  errors.clear();
+  ro = new readtolines(*sink, !(flags & EXE_RAW));
+  re = new readtostring();
+  ro->init(1, !!(flags & EXE_BIG));
+  re->init(2);
+  list<monitor *> monitors;
+  monitors.push_back(ro);
+  monitors.push_back(re);
+  if(input) {
+    wi = new writefromlines();
+    wi->init(*input, 0);
+    monitors.push_back(wi);
+    if(debug > 1)
+      report_lines(*input, "Input", "| ");
+  }
+  // The monitors are serviced whenever anything waits, until wait() collects
+  // them
+  pid = spawn(command, monitors);
+}
+
+int AsyncCommand::wait() {
+  assert(pid != -1);
+  list<monitor *> monitors;
+  monitors.push_back(ro);
+  monitors.push_back(re);
+  if(wi)
+    monitors.push_back(wi);
+  service(monitors);
+  const pid_t p = pid;
+  pid = -1;
+  const int rc = reap(p, command[0].c_str());
+  split(errors, re->str());
+  delete ro;
+  delete re;
+  delete wi;
+  ro = re = NULL;
+  wi = NULL;
+  if(debug > 1) {
+    if(sink == this)
+      report_lines(output, "Output", "| ");
+    report_lines(errors, "Errors", "| ");
+  }
+  return rc;
+}
+
+void AsyncCommand::line(const string &l) {
+  output.push_back(l);
+}
+
 /*
 Local Variables:
 c-basic-offset:2
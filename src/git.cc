@@ -94,12 +94,14 @@ public:
       for(size_t n = 0; n < files.size(); ++n)
         revertfiles.insert(files[n]);
       // Get the current tree status
-      vector<string> status;
-      capture(status, "git", "status", (char *)NULL);
+      vector<string> command;
+      LineBuffer status;
+      execute(makevs(command, "git", "status", (char *)NULL), NULL, status);
       // Find the set of new files
       set<string> newfiles;
-      for(size_t n = 0; n < status.size(); ++n) {
-        const string &line = status[n];
+      size_t next = 0;
+      LineSpan line;
+      while(status.next(next, line)) {
         size_t pos = 0;
         // Old versions of git put a # at the start, new ones don't
         if(pos < line.size() && line[pos] == '#')
@@ -107,12 +109,12 @@ public:
         while(pos < line.size() && isspace(line[pos]))
           ++pos;
         static const char prefix[] = "new file:";
-        if(line.compare(pos, (sizeof prefix)-1, prefix) == 0) {
+        if(line.has_at(pos, prefix)) {
           // It's a new file; parse out the filename
           pos += sizeof prefix - 1;
           while(pos < line.size() && isspace(line[pos]))
             ++pos;
-          const string path = line.substr(pos, string::npos);
+          const string path = line.substr(pos).str();
           // If it's one of the targets, add it to the set to remove and remove
           // from the set to checkout.
           if(revertfiles.find(path) != revertfiles.end()) {
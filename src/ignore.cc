@@ -69,7 +69,8 @@ static string fullpath(const string &path, const string &file) {
 static void listfiles_recurse(string path,
                               list<string> &files,
                               set<string> &ignored,
-                              const string *followrcs) {
+                              const string *followrcs,
+                              const DirFilter *filter) {
   DIR *dp;
   struct dirent *de;
   vector<string> dirs_here, files_here;
@@ -98,7 +99,7 @@ static void listfiles_recurse(string path,
     const int ignoreme = (is_ignored(ignores_here, name)
                           || is_ignored(global_ignores, name));
     if(isdir(fullname, followrcs && name == *followrcs)) {
-      if(!ignoreme)
+      if(!ignoreme && !(filter && filter->prune(fullname)))
         dirs_here.push_back(fullname);
     } else if(isreg(fullname, 0)) {
       files_here.push_back(fullname);
@@ -124,19 +125,21 @@ static void listfiles_recurse(string path,
   for(vector<string>::const_iterator it = dirs_here.begin();
       it != dirs_here.end();
       ++it)
-    listfiles_recurse(*it, files, ignored, followrcs);
+    listfiles_recurse(*it, files, ignored, followrcs, filter);
 }
 
 // Get a list of files below a directory plus a set of those that are ignored.
-// The ignored files WILL be in the list.
+// The ignored files WILL be in the list.  Directories that FILTER prunes are
+// skipped entirely.
 void listfiles(string path,
                list<string> &files,
                set<string> &ignored,
-               const string *followrcs) {
+               const string *followrcs,
+               const DirFilter *filter) {
   files.clear();
   ignored.clear();
   init_global_ignores();
-  listfiles_recurse(path, files, ignored, followrcs);
+  listfiles_recurse(path, files, ignored, followrcs, filter);
   if(debug > 1) {
     fprintf(stderr, "listfiles output:\n");
     for(list<string>::const_iterator it = files.begin();
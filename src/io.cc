@@ -16,6 +16,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "vcs.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 int writef(FILE *fp, const char *what, const char *fmt, ...) {
   va_list ap;
@@ -28,6 +33,226 @@ int writef(FILE *fp, const char *what, const char *fmt, ...) {
   return rc;
 }
 
+// Write data to a FILE * with a prefix at the start of each line, in large
+// chunks
+class PrefixWriter {
+public:
+  PrefixWriter(FILE *fp_, const char *what_, char prefix_):
+    fp(fp_), what(what_), prefix(prefix_), start(true) {
+    buffer.reserve(chunk + chunk / 8);
+  }
+
+  void write(const char *ptr, size_t n) {
+    const char *const end = ptr + n;
+    while(ptr < end) {
+      if(start)
+        buffer += prefix;
+      const char *nl = (const char *)memchr(ptr, '\n', end - ptr);
+      const char *stop = nl ? nl + 1 : end;
+      buffer.append(ptr, stop);
+      start = (nl != NULL);
+      ptr = stop;
+      if(buffer.size() >= chunk)
+        flush();
+    }
+  }
+
+  void flush() {
+    if(buffer.size() && fwrite(buffer.data(), 1, buffer.size(), fp)
+       != buffer.size())
+      fatal("writing to %s: %s", what, strerror(errno));
+    buffer.clear();
+  }
+
+private:
+  static const size_t chunk = 65536;
+  FILE *fp;
+  const char *what;
+  char prefix;
+  bool start;                           // true at start of a line
+  string buffer;
+};
+
+size_t count_newlines(const char *ptr, size_t n) {
+  size_t count = 0, pos = 0;
+  // Count zero bytes in (word ^ "\n\n\n...") exactly, a word at a time
+  for(; pos + 8 <= n; pos += 8) {
+    uint64_t w;
+    memcpy(&w, ptr + pos, 8);
+    w ^= 0x0a0a0a0a0a0a0a0aULL;
+    const uint64_t t = (w & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL;
+    count += __builtin_popcountll(~(t | w | 0x7f7f7f7f7f7f7f7fULL));
+  }
+  for(; pos < n; ++pos)
+    if(ptr[pos] == '\n')
+      ++count;
+  return count;
+}
+
+// Call CALLBACK(ARG, DATA, BYTES) on SIZE bytes of FD from OFFSET, a bounded
+// chunk at a time
+static void read_chunks(int fd, const string &path, off_t offset, off_t size,
+                        void (*callback)(void *, const char *, size_t),
+                        void *arg) {
+  char buffer[65536];
+  while(size > 0) {
+    const size_t want = size < (off_t)sizeof buffer ? size : sizeof buffer;
+    const ssize_t got = pread(fd, buffer, want, offset);
+    if(got < 0) {
+      if(errno == EINTR)
+        continue;
+      fatal("error reading %s: %s", path.c_str(), strerror(errno));
+    }
+    if(got == 0)
+      fatal("error reading %s: unexpected EOF", path.c_str());
+    callback(arg, buffer, got);
+    offset += got;
+    size -= got;
+  }
+}
+
+// Copy HEAD and then the rest of FD (read from PATH) to a new file DEST
+static void spool(const string &head, int fd, const string &path,
+                  const string &dest) {
+  const int out = open(dest.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  if(out < 0)
+    fatal("error opening %s: %s", dest.c_str(), strerror(errno));
+  char buffer[65536];
+  const char *ptr = head.data();
+  ssize_t got = head.size();
+  do {
+    for(ssize_t done = 0; done < got;) {
+      const ssize_t n = write(out, ptr + done, got - done);
+      if(n < 0) {
+        if(errno == EINTR)
+          continue;
+        fatal("error writing %s: %s", dest.c_str(), strerror(errno));
+      }
+      done += n;
+    }
+    ptr = buffer;
+    while((got = read(fd, buffer, sizeof buffer)) < 0 && errno == EINTR)
+      ;
+    if(got < 0)
+      fatal("error reading %s: %s", path.c_str(), strerror(errno));
+  } while(got > 0);
+  if(close(out) < 0)
+    fatal("error closing %s: %s", dest.c_str(), strerror(errno));
+}
+
+// Read up to LIMIT bytes of FD (read from PATH) into HEAD.  Returns true if
+// that reached EOF.
+static bool read_head(int fd, const string &path, string &head,
+                      size_t limit) {
+  char buffer[65536];
+  while(head.size() < limit) {
+    const ssize_t got = read(fd, buffer, sizeof buffer);
+    if(got < 0) {
+      if(errno == EINTR)
+        continue;
+      fatal("error reading %s: %s", path.c_str(), strerror(errno));
+    }
+    if(got == 0)
+      return true;
+    head.append(buffer, got);
+  }
+  return false;
+}
+
+struct LineCount {
+  size_t lines;
+  char last;
+};
+
+static void count_chunk(void *arg, const char *ptr, size_t n) {
+  LineCount *lc = (LineCount *)arg;
+  lc->lines += count_newlines(ptr, n);
+  lc->last = ptr[n - 1];
+}
+
+static void write_chunk(void *arg, const char *ptr, size_t n) {
+  ((PrefixWriter *)arg)->write(ptr, n);
+}
+
+// The hunk header counts a final line even if it has no newline
+static void write_header(FILE *fp, const char *what, char prefix,
+                         const LineCount &lc) {
+  writef(fp, what, prefix == '+' ? "@@ -0,0 +1,%zu @@\n"
+                                 : "@@ -1,%zu +0,0 @@\n",
+         lc.lines + (lc.last != '\n'));
+}
+
+static void write_trailer(FILE *fp, const char *what, const LineCount &lc) {
+  if(lc.last != '\n')
+    writef(fp, what, "\n\\ No newline at end of file\n");
+}
+
+// write_whole_diff() for SIZE bytes at DATA
+static void write_whole_data(FILE *fp, const char *what, char prefix,
+                             const char *data, size_t size) {
+  PrefixWriter writer(fp, what, prefix);
+  LineCount lc = { 0, '\n' };
+  if(size)
+    count_chunk(&lc, data, size);
+  write_header(fp, what, prefix, lc);
+  writer.write(data, size);
+  writer.flush();
+  write_trailer(fp, what, lc);
+}
+
+void write_whole_diff(FILE *fp, const char *what, const string &path,
+                      char prefix, off_t offset, off_t size) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0)
+    fatal("error opening %s: %s", path.c_str(), strerror(errno));
+  struct stat sb;
+  if(fstat(fd, &sb) < 0)
+    fatal("error calling fstat %s: %s", path.c_str(), strerror(errno));
+  if(!S_ISREG(sb.st_mode)) {
+    // A pipe can only be read once, but the line count has to come first.
+    // Small inputs are kept in memory; bigger ones are copied to a
+    // temporary file, so memory use stays bounded either way.
+    string head;
+    if(read_head(fd, path, head, 1 << 20)) {
+      close(fd);
+      const off_t start = offset < (off_t)head.size() ? offset : head.size();
+      if(size < 0 || start + size > (off_t)head.size())
+        size = head.size() - start;
+      write_whole_data(fp, what, prefix, head.data() + start, size);
+      return;
+    }
+    TempFile tmp;
+    spool(head, fd, path, tmp.path());
+    close(fd);
+    write_whole_diff(fp, what, tmp.path(), prefix, offset, size);
+    return;
+  }
+  if(size < 0)
+    size = sb.st_size - offset;
+  // mmap() offsets must be page-aligned
+  const off_t skip = offset % sysconf(_SC_PAGESIZE);
+  void *map = MAP_FAILED;
+  if(size > 0)
+    map = mmap(NULL, size + skip, PROT_READ, MAP_PRIVATE, fd, offset - skip);
+  if(map != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+    madvise(map, size + skip, MADV_SEQUENTIAL);
+#endif
+    write_whole_data(fp, what, prefix, (const char *)map + skip, size);
+    munmap(map, size + skip);
+  } else {
+    // Two passes with a bounded buffer
+    PrefixWriter writer(fp, what, prefix);
+    LineCount lc = { 0, '\n' };
+    read_chunks(fd, path, offset, size, count_chunk, &lc);
+    write_header(fp, what, prefix, lc);
+    read_chunks(fd, path, offset, size, write_chunk, &writer);
+    writer.flush();
+    write_trailer(fp, what, lc);
+  }
+  close(fd);
+}
+
 /*
 Local Variables:
 mode:c++
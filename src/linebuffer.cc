@@ -0,0 +1,187 @@
+/*
+ * This file is part of VCS
+ * Copyright (C) 2026 Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "vcs.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Enough for most command output, so that usually there is only one
+// allocation
+static const size_t initial_capacity = 65536;
+
+// Size of the staging area once output is going to a spill file
+static const size_t staging_capacity = 1 << 20;
+
+const size_t LineBuffer::large;
+
+size_t LineSpan::find(char c, size_t pos) const {
+  if(pos >= len)
+    return string::npos;
+  const char *p = (const char *)memchr(ptr + pos, c, len - pos);
+  return p ? p - ptr : string::npos;
+}
+
+LineSpan LineSpan::substr(size_t pos, size_t n) const {
+  if(pos > len)
+    pos = len;
+  if(n > len - pos)
+    n = len - pos;
+  return LineSpan(ptr + pos, n);
+}
+
+bool LineSpan::has_at(size_t pos, const char *s) const {
+  const size_t n = strlen(s);
+  return pos <= len && n <= len - pos && memcmp(ptr + pos, s, n) == 0;
+}
+
+LineBuffer::LineBuffer(size_t spill_): buffer(NULL), used(0), capacity(0),
+                                      spill(spill_), fd(-1), spilled(0),
+                                      mapped(false) {
+}
+
+LineBuffer::~LineBuffer() {
+  release();
+}
+
+// Discard everything, including any spill file
+void LineBuffer::release() {
+  if(mapped)
+    munmap(buffer, used);
+  else
+    free(buffer);
+  if(fd != -1)
+    close(fd);
+  buffer = NULL;
+  used = capacity = spilled = 0;
+  fd = -1;
+  mapped = false;
+}
+
+void LineBuffer::clear() {
+  if(mapped || fd != -1)
+    release();
+  else
+    used = 0;
+}
+
+bool LineBuffer::next(size_t &pos, LineSpan &line) const {
+  if(pos >= used)
+    return false;
+  const char *const start = buffer + pos;
+  const char *nl = (const char *)memchr(start, '\n', used - pos);
+  if(nl) {
+    line = LineSpan(start, nl - start);
+    pos += line.len + 1;
+  } else {
+    line = LineSpan(start, used - pos);
+    pos = used;
+  }
+  return true;
+}
+
+size_t LineBuffer::lines() const {
+  const size_t n = count_newlines(buffer, used);
+  return (used && buffer[used - 1] != '\n') ? n + 1 : n;
+}
+
+char *LineBuffer::space(size_t &n) {
+  assert(!mapped);
+  // Once spilling, the buffer is just somewhere to collect writes
+  if(fd != -1 && capacity - used < n)
+    flush();
+  if(capacity - used < n) {
+    size_t c = capacity ? capacity * 2 : initial_capacity;
+    while(c - used < n)
+      c *= 2;
+    char *const b = (char *)realloc(buffer, c);
+    if(!b)
+      fatal("error calling realloc: %s", strerror(errno));
+    buffer = b;
+    capacity = c;
+  }
+  n = capacity - used;
+  return buffer + used;
+}
+
+void LineBuffer::commit(size_t n) {
+  used += n;
+  if(spill && fd == -1 && used > spill) {
+    // Move everything so far to a temporary file that nothing else can see
+    // and that goes away by itself
+    const string path = tempfile();
+    if((fd = open(path.c_str(), O_RDWR)) < 0)
+      fatal("error opening %s: %s", path.c_str(), strerror(errno));
+    if(unlink(path.c_str()) < 0)
+      fatal("error removing %s: %s", path.c_str(), strerror(errno));
+    flush();
+    char *const b = (char *)realloc(buffer, staging_capacity);
+    if(!b)
+      fatal("error calling realloc: %s", strerror(errno));
+    buffer = b;
+    capacity = staging_capacity;
+  }
+}
+
+void LineBuffer::append(const char *ptr, size_t n) {
+  size_t avail = n;
+  memcpy(space(avail), ptr, n);
+  commit(n);
+}
+
+// Write the staging area to the spill file
+void LineBuffer::flush() {
+  size_t done = 0;
+  while(done < used) {
+    const ssize_t n = write(fd, buffer + done, used - done);
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      fatal("error writing spill file: %s", strerror(errno));
+    }
+    done += n;
+  }
+  spilled += used;
+  used = 0;
+}
+
+void LineBuffer::finish() {
+  if(fd == -1)
+    return;
+  flush();
+  void *const map = mmap(NULL, spilled, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(map == MAP_FAILED)
+    fatal("error calling mmap: %s", strerror(errno));
+  madvise(map, spilled, MADV_SEQUENTIAL);
+  // The mapping keeps the file alive
+  close(fd);
+  fd = -1;
+  free(buffer);
+  buffer = (char *)map;
+  used = capacity = spilled;
+  mapped = true;
+}
+
+/*
+Local Variables:
+mode:c++
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
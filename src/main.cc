@@ -26,6 +26,7 @@ static const struct option options[] = {
   { "verbose", no_argument, 0, 'v' },
   { "dry-run", no_argument, 0, 'n' },
   { "debug", no_argument, 0, 'd' },
+  { "jobs", required_argument, 0, 'j' },
   { 0, 0, 0, 0 }
 };
 
@@ -37,6 +38,7 @@ static void help(FILE *fp = stdout) {
           "  -v, --verbose     Verbose operation\n"
           "  -n, --dry-run     Report what would be done but do nothing\n"
           "  -d, --debug       Display debug messages (-dd for more)\n"
+          "  -j, --jobs N      Run up to N native commands at once\n"
           "  -h, --help        Display usage message\n"
           "  -H, --commands    Display command list\n"
           "  -V, --version     Display version number\n"
@@ -59,7 +61,7 @@ static int Main(int argc, char **argv) {
   if(!setlocale(LC_CTYPE, ""))
     fatal("error calling setlocale: %s", strerror(errno));
   // Parse global options
-  while((n = getopt_long(argc, argv, "+hVHgvn46d", options, 0)) >= 0) {
+  while((n = getopt_long(argc, argv, "+hVHgvn46dj:", options, 0)) >= 0) {
     switch(n) {
     case 'h':
       help();
@@ -88,6 +90,10 @@ static int Main(int argc, char **argv) {
     case 'd':
       ++debug;
       break;
+    case 'j':
+      if((jobs = atoi(optarg)) <= 0)
+        fatal("invalid job count '%s'", optarg);
+      break;
     default:
       exit(1);
     }
@@ -18,6 +18,189 @@
 #include "vcs.h"
 #include "p4utils.h"
 #include <sstream>
+#include <sys/stat.h>
+
+// Encode and dot-stuff FILES as arguments for p4 in ARGS
+static void p4_args(vector<string> &args, const vector<string> &files) {
+  args.clear();
+  for(size_t n = 0; n < files.size(); ++n) {
+    const string e = p4_encode(files[n]);
+    args.push_back(e.size() && e[0] == '-' ? "./" + e : e);
+  }
+}
+
+// Find field NAME in change form FORM and return the index of its first
+// value line, or FORM.size() if absent.  If BODY is not NULL it is set to
+// the field's value lines.
+static size_t form_field(const vector<string> &form, const string &name,
+                         vector<string> *body = NULL) {
+  size_t n = 0;
+  while(n < form.size() && form[n] != name + ":")
+    ++n;
+  if(n == form.size())
+    return n;
+  ++n;
+  if(body) {
+    body->clear();
+    for(size_t m = n; (m < form.size()
+                       && form[m].size()
+                       && (form[m][0] == '\t' || form[m][0] == ' ')); ++m)
+      body->push_back(form[m]);
+  }
+  return n;
+}
+
+// Replace the value of field NAME in FORM with BODY, adding it if absent
+static void form_replace(vector<string> &form, const string &name,
+                         const vector<string> &body) {
+  size_t n = form_field(form, name);
+  if(n == form.size()) {
+    form.push_back(name + ":");
+    n = form.size();
+  }
+  while(n < form.size()
+        && form[n].size()
+        && (form[n][0] == '\t' || form[n][0] == ' '))
+    form.erase(form.begin() + n);
+  form.insert(form.begin() + n, body.begin(), body.end());
+}
+
+// Strip surrounding whitespace from a form value line
+static string field_value(const string &l) {
+  const string::size_type n = l.find_first_not_of(" \t");
+  if(n == string::npos)
+    return string();
+  return l.substr(n, l.find_last_not_of(" \t") + 1 - n);
+}
+
+// Return true if PATH is a regular file with write permission.  p4 clears
+// the write bits on files that aren't open, so unlike access() this is
+// meaningful even for root.  It proves nothing on allwrite clients or for +w
+// filetypes, though.
+static bool writable_file(const string &path) {
+  struct stat sb;
+  return (stat(path.c_str(), &sb) == 0
+          && S_ISREG(sb.st_mode)
+          && (sb.st_mode & S_IWUSR));
+}
+
+// Just collect the file list from 'p4 describe'
+class ListDescribe: public P4Describe {
+  void output(const string &) {
+  }
+};
+
+// Copy 'p4 describe' output to stdout as it arrives.  Blank lines are held
+// back until something follows them so that the output doesn't end with one.
+// The files in WHOLE, which p4 doesn't diff, are written from PRINT at the
+// point where they come in the change's file list.  If one of them hasn't
+// been printed yet when it's due then the output after it is held until it
+// has.
+class ShowDescribe: public P4Describe, public P4PrintProgress {
+public:
+  ShowDescribe(const vector<fileinfo> &whole_, const P4Print &print_):
+    blanks(0), whole(whole_), print(print_), next(0), ready(0) {
+  }
+
+  // Called as files of WHOLE arrive
+  void printed(size_t n) {
+    ready = n;
+    while(held.size() && process(held.front()))
+      held.pop_front();
+  }
+
+  // Write whatever is left
+  void finish() {
+    printed(whole.size());
+    while(next < whole.size())
+      write_whole(next++);
+  }
+
+private:
+  size_t blanks;
+  const vector<fileinfo> &whole;
+  const P4Print &print;
+  size_t next;                          // next file of WHOLE to write
+  size_t ready;                         // files of WHOLE printed so far
+  map<string,size_t> position;          // depot path -> index in file list
+  list<string> held;                    // output waiting for PRINT
+
+  void output(const string &l) {
+    if(held.size())
+      held.push_back(l);
+    else if(!process(l)) {
+      held.push_back(l);
+      // Show everything so far while waiting
+      if(fflush(stdout) < 0)
+        fatal("writing to stdout: %s\n", strerror(errno));
+    }
+  }
+
+  // Write L, and anything from WHOLE due before it.  Returns false if
+  // something due hasn't been printed yet.
+  bool process(const string &l) {
+    if(l.empty()) {
+      ++blanks;
+      return true;
+    }
+    const string::size_type hash = l.find('#');
+    if(l.compare(0, 6, "... //") == 0 && hash != string::npos) {
+      // ... //depot/path#REV ACTION
+      const size_t n = position.size();
+      position[string(l, 4, hash - 4)] = n;
+    } else if(l.compare(0, 7, "==== //") == 0 && hash != string::npos) {
+      // ==== //depot/path#REV (TYPE) ====
+      const string path(l, 5, hash - 5);
+      const size_t here = position[path];
+      while(next < whole.size() && position[whole[next].depot_path] < here) {
+        if(next >= ready)
+          return false;
+        write_whole(next++);
+      }
+      if(next < whole.size() && whole[next].depot_path == path)
+        ++next;                         // p4 has diffed it after all
+    }
+    flush_blanks();
+    writef(stdout, "stdout", "%s\n", l.c_str());
+    return true;
+  }
+
+  void flush_blanks() {
+    for(; blanks; --blanks)
+      writef(stdout, "stdout", "\n");
+  }
+
+  // Write file N of WHOLE in full
+  void write_whole(size_t n) {
+    const fileinfo &file = whole[n];
+    const P4Print::file &contents = print[n];
+    if(!contents.found)
+      return;
+    const bool deleted = file.action == "delete";
+    writef(stdout, "stdout", "\n==== %s#%d (%s) ====\n\n",
+           file.depot_path.c_str(), file.rev, contents.type.c_str());
+    if(contents.type == "binary")
+      writef(stdout, "stdout", "%s %s a binary file\n",
+             file.depot_path.c_str(), deleted ? "was" : "is");
+    else
+      write_whole_diff(stdout, "stdout", print.spool(), deleted ? '-' : '+',
+                       contents.offset, contents.size);
+    if(fflush(stdout) < 0)
+      fatal("writing to stdout: %s\n", strerror(errno));
+  }
+};
+
+// Copy 'p4 sync' output to stdout as it arrives, keeping it for the have
+// list cache
+class SyncEcho: public LineSink {
+public:
+  vector<string> lines;
+
+  void line(const string &l) {
+    writef(stdout, "stdout", "%s\n", l.c_str());
+    lines.push_back(l);
+  }
+};
 
 class p4: public vcs {
 public:
@@ -45,18 +228,61 @@ public:
     return false;
   }
 
+  // File lists are passed on standard input with 'p4 -x -', so there is no
+  // limit on their length and only one p4 process is needed.
+
   int edit(const vector<string> &files) const {
-    vector<string> encoded = p4_encode(files);
-    return execute("p4",
-                   EXE_STR, "edit",
-                   EXE_VECTOR|EXE_DOTSTUFF, &encoded,
-                   EXE_END);
+    // Files we know to be open already needn't be opened again.  A file that
+    // isn't writable can't be open, whatever the cache says, so only files
+    // that are both recorded and writable are skipped.
+    P4OpenedCache cache;
+    vector<string> needed, canonical;
+    for(size_t n = 0; n < files.size(); ++n) {
+      const string c = P4OpenedCache::canonical(files[n]);
+      if(cache.contains(c) && writable_file(files[n]))
+        continue;
+      needed.push_back(files[n]);
+      canonical.push_back(c);
+    }
+    if(!needed.size()) {
+      if(verbose)
+        fprintf(stderr, "all files already open for edit\n");
+      return 0;
+    }
+    if(dryrun)
+      return execute("p4",
+                     EXE_STR, "-x",
+                     EXE_STR, "-",
+                     EXE_STR, "edit",
+                     EXE_INPUT|EXE_DOTSTUFF|EXE_P4, &needed,
+                     EXE_END);
+    vector<string> command, input, output, errors;
+    p4_args(input, needed);
+    makevs(command, "p4", "-x", "-", "edit", (char *)NULL);
+    if(verbose) {
+      display_command(command);
+      report_lines(input, NULL, "| ");
+    }
+    const int rc = execute(command, &input, &output, &errors);
+    report_lines(output, NULL, NULL, stdout);
+    if(fflush(stdout) < 0)
+      fatal("writing to stdout: %s", strerror(errno));
+    report_lines(errors);
+    // Only a clean run tells us that every file is now open
+    if(!rc && !errors.size()) {
+      cache.add(canonical);
+      cache.save();
+    }
+    return rc;
   }
 
   int diff(const vector<string> &files) const {
     if(files.size()) {
+      // One query covering just the named files serves all of them
+      P4Info info;
+      info.gather(files);
       for(size_t n = 0; n < files.size(); ++n)
-        diff_one(files[n]);
+        diff_one(info, files[n]);
     } else {
       diff_all();
     }
@@ -69,17 +295,20 @@ public:
     if(!nondirs.size())
       return 0;
     return execute("p4",
+                   EXE_STR, "-x",
+                   EXE_STR, "-",
                    EXE_STR, "add",
                    EXE_STR, "-f",
-                   EXE_VECTOR|EXE_DOTSTUFF, &nondirs,
+                   EXE_INPUT|EXE_DOTSTUFF, &nondirs,
                    EXE_END);
   }
 
   int remove(int /*force*/, const vector<string> &files) const {
-    vector<string> encoded = p4_encode(files);
     return execute("p4",
+                   EXE_STR, "-x",
+                   EXE_STR, "-",
                    EXE_STR, "delete",
-                   EXE_VECTOR|EXE_DOTSTUFF, &encoded,
+                   EXE_INPUT|EXE_DOTSTUFF|EXE_P4, &files,
                    EXE_END);
   }
 
@@ -102,152 +331,180 @@ public:
 
     // The easy case is when there are no files listed.
     if(!files.size()) {
+      int rc;
       if(msg)
-        return execute("p4",
-                       EXE_STR, "submit",
-                       EXE_STR, "-d",
-                       EXE_STRING, msg,
-                       EXE_STR, "...",
-                       EXE_END);
+        rc = execute("p4",
+                     EXE_STR, "submit",
+                     EXE_STR, "-d",
+                     EXE_STRING, msg,
+                     EXE_STR, "...",
+                     EXE_END);
       else
-        return execute("p4",
-                       EXE_STR, "submit",
-                       EXE_STR, "...",
-                       EXE_END);
+        rc = execute("p4",
+                     EXE_STR, "submit",
+                     EXE_STR, "...",
+                     EXE_END);
+      forget_opened(files);
+      return rc;
     }
 
     // Some files were listed.  There might or might not be a message.  Either
-    // way we need to construct a change form.
-
+    // way we need to construct a change form.  The depot paths of the files
+    // are fetched in the background, so that if the user has to write a
+    // message they do so while that query is running.
     int rc;
-    vector<string> change;
-    vector<string>::size_type n, m;
-
-    // Get the default change form
-    if((rc = capture(change, "p4", "change", "-o", (char *)NULL)))
-      fatal("'p4 change -o' exited with status %d", rc);
-    n = 0;
-    // Find the default description
-    while(n < change.size() && change[n] != "Description:")
-      ++n;
-    if(msg) {
-      // Erase it
-      ++n;
-      while(n < change.size()
-            && change[n].size()
-            && (change[n].at(0) == '\t'
-                || change[n].at(0) == ' '))
-        change.erase(change.begin() + n);
-      // Insert the user's message instead
-      change.insert(change.begin() + n, "\t" + *msg);
-      ++n;
-      // ..pointing just after the message text
-    } else {
-      // Step over it
-      ++n;
-      while(n < change.size()
-            && change[n].size()
-            && (change[n].at(0) == '\t'
-                || change[n].at(0) == ' '))
-        ++n;
-      // ..pointing just after the default message text
-    }
-    // Find the Files: section
-    while(n < change.size() && change[n] != "Files:")
-      ++n;
-    // Erase it
-    ++n;
-    while(n < change.size()
-          && change[n].size()
-          && (change[n].at(0) == '\t'
-              || change[n].at(0) == ' '))
-      change.erase(change.begin() + n);
-    // Translate the list of files to submit
     vector<string> cmd;
-    vector<string> where;
-    cmd.push_back("p4");
-    cmd.push_back("where");
-    for(m = 0; m < files.size(); ++m) {
+    for(size_t m = 0; m < files.size(); ++m)
       if(!exists(files[m]))
         fatal("%s does not exist", files[m].c_str());
-      cmd.push_back(p4_encode(files[m]));
+    const vector<string> encoded = p4_encode(files);
+    AsyncCommand change, where;
+    change.start(makevs(cmd, "p4", "change", "-o", (char *)NULL));
+    where.start(makevs(cmd, "p4", "-x", "-", "where", (char *)NULL),
+                0, &encoded);
+    // Get the default change form
+    if((rc = change.wait())) {
+      report_lines(change.errors);
+      fatal("'p4 change -o' exited with status %d", rc);
+    }
+    vector<string> listed = files;
+    if(msg) {
+      vector<string> description(1, "\t" + *msg);
+      form_replace(change.output, "Description", description);
+    } else if(!dryrun) {
+      // Let the user edit the form at once.  The Files: section lists local
+      // names for now and is translated afterwards, with whatever they leave
+      // there.
+      vector<string> local, before, after;
+      for(size_t m = 0; m < files.size(); ++m)
+        local.push_back("\t" + files[m]);
+      form_replace(change.output, "Files", local);
+      form_field(change.output, "Description", &before);
+      if((rc = editor(change.output)))
+        return rc;
+      // p4's default description is only a placeholder
+      form_field(change.output, "Description", &after);
+      bool empty = true;
+      for(size_t m = 0; m < after.size(); ++m)
+        if(field_value(after[m]).size())
+          empty = false;
+      if(empty || after == before)
+        fatal("change description not edited, not submitting");
+      vector<string> lines;
+      form_field(change.output, "Files", &lines);
+      listed.clear();
+      for(size_t m = 0; m < lines.size(); ++m)
+        if(field_value(lines[m]).size())
+          listed.push_back(field_value(lines[m]));
+      if(!listed.size())
+        fatal("no files to submit");
     }
-    if((rc = vcapture(where, cmd)))
+    // Translate the list of files to submit.  If the user changed it then the
+    // background query answered the wrong question.
+    if((rc = where.wait())) {
+      report_lines(where.errors);
       fatal("'p4 where PATHS' exited with status %d", rc);
-    // Output is %-encoded, we keep it that way
-    for(m = 0; m < where.size(); ++m) {
-      change.insert(change.begin() + n,
-                    "\t" + where[m].substr(0, where[m].find(' ')));
-      ++n;
     }
-    // Now we have a change.  If a message was specified we submit straight away
-    // and that's all we need.
-    if(msg)
-      return inject(change, "p4", "submit", "-i", (char *)NULL);
-    if(dryrun) {
-      // Popping up a form to fill in in dry-run mode makes no sense, so we just
-      // show them what the un-edited form would look like.
-      return inject(change, "p4", "submit", "-i", (char *)NULL);
+    report_lines(where.errors);
+    if(listed != files) {
+      for(size_t m = 0; m < listed.size(); ++m)
+        if(!exists(listed[m]))
+          fatal("%s does not exist", listed[m].c_str());
+      const vector<string> reencoded = p4_encode(listed);
+      if((rc = execute(makevs(cmd, "p4", "-x", "-", "where", (char *)NULL),
+                       &reencoded, &where.output)))
+        fatal("'p4 where PATHS' exited with status %d", rc);
     }
-    // Give the user a chance to edit the change form
-    rc = editor(change);
-    if(rc)
-      return rc;
-    // Submit the edited change
-    return inject(change, "p4", "submit", "-i", (char *)NULL);
+    // Output is %-encoded, we keep it that way
+    vector<string> depot;
+    for(size_t m = 0; m < where.output.size(); ++m)
+      depot.push_back("\t" + where.output[m].substr(0,
+                                                     where.output[m].find(' ')));
+    form_replace(change.output, "Files", depot);
+    // In dry-run mode this just shows what the form would look like
+    rc = inject(change.output, "p4", "submit", "-i", (char *)NULL);
+    forget_opened(listed);
+    return rc;
   }
 
   int revert(const vector<string> &files) const {
+    int rc;
     if(files.size()) {
-      vector<string> encoded = p4_encode(files);
-      return execute("p4",
-                     EXE_STR, "revert",
-                     EXE_VECTOR|EXE_DOTSTUFF, &encoded,
-                     EXE_END);
+      rc = execute("p4",
+                   EXE_STR, "-x",
+                   EXE_STR, "-",
+                   EXE_STR, "revert",
+                   EXE_INPUT|EXE_DOTSTUFF|EXE_P4, &files,
+                   EXE_END);
     } else
-      return execute("p4",
-                     EXE_STR, "revert",
-                     EXE_STR, "...",
-                     EXE_END);
+      rc = execute("p4",
+                   EXE_STR, "revert",
+                   EXE_STR, "...",
+                   EXE_END);
+    forget_opened(files);
+    return rc;
   }
 
   int status() const {
-    // Find out what P4 knows
+    // Find out what P4 knows.  This is the only user of the resolve and
+    // changed states.  The queries run while we scan the filesystem.
     P4Info p4info;
+    const unsigned groups = P4Info::Files|P4Info::Resolve|P4Info::Changed;
     p4info.gather();
+    p4info.want(groups);
+    P4ClientView view;
+    view.start();
 
-    // Get a list of all files, with relative path names
+    // Get a list of all files, with relative path names.  Directories that
+    // the client view doesn't map are skipped.  If a cached view turns out
+    // to be out of date then the walk is repeated with the current one.
     list<string> files;
     set<string> ignored;
-    listfiles("", files, ignored);
+    view.load();
+    listfiles("", files, ignored, NULL, &view);
+    if(!view.confirm()) {
+      files.clear();
+      ignored.clear();
+      listfiles("", files, ignored, NULL, &view);
+    }
 
-    // We'll accumulate the status info here
-    typedef map<string,char,ltfilename> status_type;
+    // We'll accumulate the status info here, indexed by sort key so that
+    // the output is grouped by directory
+    typedef map<string,pair<string,char> > status_type;
     status_type status;
 
     // We'll accumulate a list of files that are in p4 but also ignored.
     list<string> known_ignored;
 
     // First from p4
-    list<string> p4relpaths;
-    p4info.relative_list(p4relpaths);
-    for(list<string>::const_iterator it = p4relpaths.begin();
-        it != p4relpaths.end();
-        ++it) {
-      P4FileInfo fi;
-      p4info.relative_find(*it, fi);
-      status[*it] = fi.action.size() ? toupper(fi.action[0]) : 0;
+    vector<const P4FileInfo *> p4files;
+    vector<string> opened;
+    p4info.all(p4files, groups);
+    for(size_t n = 0; n < p4files.size(); ++n) {
+      const P4FileInfo &fi = *p4files[n];
+      if(fi.action.size() && fi.local_path.size())
+        opened.push_back(P4OpenedCache::canonical(fi.local_path));
+      const string &path = fi.relative_path;
+      pair<string,char> &entry = status[ltfilename::key(path)];
+      char &st = entry.second;
+      entry.first = path;
+      st = fi.action.size() ? toupper(fi.action[0]) : 0;
       if(!fi.changed)
-        status[*it] = tolower(status[*it]);
+        st = tolower(st);
       if(fi.resolvable) {
-        fprintf(stderr, "resolvable: %s\n", it->c_str());
-        status[*it] = 'R';
+        fprintf(stderr, "resolvable: %s\n", path.c_str());
+        st = 'R';
       }
-      if(ignored.find(*it) != ignored.end())
+      if(ignored.find(path) != ignored.end())
         // Stash ignored files known to P4 for a moan later on
-        known_ignored.push_back(*it);
+        known_ignored.push_back(path);
     }
 
+    // We've just been told everything that's open here
+    P4OpenedCache cache;
+    cache.replace(cwd(), opened);
+    cache.save();
+
     // Now from the file list
     for(list<string>::const_iterator it = files.begin();
         it != files.end();
@@ -256,10 +513,11 @@ public:
       if(ignored.find(*it) != ignored.end())
         continue;
       // Skip files that p4 knows about
-      if(status.find(*it) != status.end())
+      const string key = ltfilename::key(*it);
+      if(status.find(key) != status.end())
         continue;
       // The rest are unknown
-      status[*it] = '?';
+      status[key] = pair<string,char>(*it, '?');
     }
 
     // So what should dry-run mode do here?  At the moment we carry on
@@ -269,8 +527,9 @@ public:
     for(status_type::const_iterator it = status.begin();
         it != status.end();
         ++it) {
-      if(it->second)
-        writef(stdout, "stdout", "%c %s\n", it->second, it->first.c_str());
+      if(it->second.second)
+        writef(stdout, "stdout", "%c %s\n", it->second.second,
+               it->second.first.c_str());
     }
 
     // Ensure warnings come right after the output so they are not swamped
@@ -287,10 +546,23 @@ public:
   }
 
   int update() const {
-    return execute("p4",
-                   EXE_STR, "sync",
-                   EXE_STR, "...",
-                   EXE_END);
+    // Keep the have list cache, if there is one, up to date with what we sync
+    P4HaveCache cache;
+    if(dryrun || !cache.exists())
+      return execute("p4",
+                     EXE_STR, "sync",
+                     EXE_STR, "...",
+                     EXE_END);
+    vector<string> command;
+    SyncEcho output;
+    makevs(command, "p4", "sync", "...", (char *)0);
+    if(verbose)
+      display_command(command);
+    const int rc = execute(command, output);
+    if(rc)
+      return rc;
+    cache.update(output.lines);
+    return 0;
   }
 
   int log(const string *path) const {
@@ -309,122 +581,251 @@ public:
                    EXE_END);
   }
 
-  void rename_one(const string &source, const string &destination) const {
-    string sp, dp;
-    if(isdir(source)) {
-      sp = source + "/...";
-      dp = destination + "/...";
-    } else {
-      sp = source;
-      dp = destination;
+  int rename(const vector<string> &sources,
+             const string &destination) const {
+    vector<pair<string,string> > pairs;
+    rename_pairs(sources, destination, pairs);
+    // Arguments for 'p4 move', in pairs
+    vector<string> from, moves;
+    for(size_t n = 0; n < pairs.size(); ++n) {
+      string sp = pairs[n].first, dp = pairs[n].second;
+      if(isdir(sp)) {
+        sp += "/...";
+        dp += "/...";
+      }
+      from.push_back(sp);
+      moves.push_back(sp);
+      moves.push_back(dp);
+    }
+    if(dryrun) {
+      execute("p4",
+              EXE_STR, "-x",
+              EXE_STR, "-",
+              EXE_STR, "edit",
+              EXE_INPUT|EXE_DOTSTUFF|EXE_P4, &from,
+              EXE_END);
+      return execute("p4",
+                     EXE_STR, "-x",
+                     EXE_STR, "-",
+                     EXE_STR, "-b",
+                     EXE_STR, "2",
+                     EXE_STR, "move",
+                     EXE_INPUT|EXE_DOTSTUFF|EXE_P4, &moves,
+                     EXE_END);
+    }
+    // 'p4 move' only works on files open for edit.  Remember which ones we
+    // opened so they can be put back if it turns out not to be available.
+    vector<string> command, input, output, errors, opened;
+    p4_args(input, from);
+    makevs(command, "p4", "-x", "-", "edit", (char *)NULL);
+    if(verbose) {
+      display_command(command);
+      report_lines(input, NULL, "| ");
     }
+    int rc = execute(command, &input, &output);
+    report_lines(output, NULL, NULL, stdout);
+    if(fflush(stdout) < 0)
+      fatal("writing to stdout: %s", strerror(errno));
+    if(rc)
+      return 1;
+    static const char opened_for_edit[] = " - opened for edit";
+    for(size_t n = 0; n < output.size(); ++n) {
+      const string &l = output[n];
+      const string::size_type e = l.rfind(opened_for_edit);
+      if(e != string::npos && e + strlen(opened_for_edit) == l.size())
+        opened.push_back(l.substr(0, l.rfind('#', e)));
+    }
+    // All the moves go to one p4 process, two arguments at a time
+    p4_args(input, moves);
+    makevs(command, "p4", "-x", "-", "-b", "2", "move", (char *)NULL);
+    if(verbose) {
+      display_command(command);
+      report_lines(input, NULL, "| ");
+    }
+    rc = execute(command, &input, &output, &errors);
+    report_lines(output, NULL, NULL, stdout);
+    if(fflush(stdout) < 0)
+      fatal("writing to stdout: %s", strerror(errno));
+    for(size_t n = 0; n < errors.size(); ++n)
+      if(errors[n].find("Unknown command") != string::npos)
+        return rename_fallback(from, moves, opened);
+    report_lines(errors);
+    return rc ? 1 : 0;
+  }
+
+  // Rename with integrate and delete, for servers without 'p4 move'
+  int rename_fallback(const vector<string> &from,
+                      const vector<string> &moves,
+                      const vector<string> &opened) const {
+    if(opened.size()
+       && execute("p4",
+                  EXE_STR, "-x",
+                  EXE_STR, "-",
+                  EXE_STR, "revert",
+                  EXE_INPUT, &opened,
+                  EXE_END))
+      return 1;
     if(execute("p4",
+               EXE_STR, "-x",
+               EXE_STR, "-",
+               EXE_STR, "-b",
+               EXE_STR, "2",
                EXE_STR, "integrate",
                EXE_STR, "-t",
-               EXE_STRING|EXE_DOTSTUFF|EXE_P4, &sp,
-               EXE_STRING|EXE_DOTSTUFF|EXE_P4, &dp,
+               EXE_INPUT|EXE_DOTSTUFF|EXE_P4, &moves,
                EXE_END))
-      exit(1);
+      return 1;
     if(execute("p4",
+               EXE_STR, "-x",
+               EXE_STR, "-",
                EXE_STR, "delete",
-               EXE_STRING|EXE_DOTSTUFF|EXE_P4, &sp,
+               EXE_INPUT|EXE_DOTSTUFF|EXE_P4, &from,
                EXE_END))
-      exit(1);
+      return 1;
+    return 0;
   }
 
   int show(const string &change) const {
-    string type;
-    vector<string> lines;
-    static const char diffs[] = "Differences ...";
-    P4Describe description(change.c_str());
-    for(size_t n = 0;
-        (n < description.lines.size()
-         && description.lines[n] != diffs);
-        ++n)
-      writef(stdout, "stdout", "%s\n", description.lines[n].c_str());
-    writef(stdout, "stdout", "%s\n", diffs);
-    for(size_t n = 0; n < description.files.size(); ++n) {
-      writef(stdout, "stdout", "\n");
-      const P4Describe::fileinfo &file = description.files[n];
-      if(file.line) {
-        // p4 has produce the diff for us
-        for(size_t m = file.line;
-            m < description.lines.size()
-              && (description.lines[m].size() || m == file.line + 1);
-            ++m) {
-          writef(stdout, "stdout", "%s\n", description.lines[m].c_str());
-        }
-      } else if(file.action == "add" || file.action == "branch") {
-        // File was added in this revision
-        retrieve_file(file.depot_path, lines, &type, file.rev);
-        writef(stdout, "stdout", "==== %s#%d (%s) ====\n\n",
-               file.depot_path.c_str(), file.rev, type.c_str());
-        if(type == "binary")
-          writef(stdout, "stdout", "%s is a binary file\n",
-                 file.depot_path.c_str());
-        else
-          diff_whole(lines, '+');
-      } else if(file.action == "delete") {
-        // File was removed in this revision
-        retrieve_file(file.depot_path, lines, &type, file.rev - 1);
-        writef(stdout, "stdout", "==== %s#%d (%s) ====\n\n",
-               file.depot_path.c_str(), file.rev, type.c_str());
-        if(type == "binary")
-          writef(stdout, "stdout", "%s was a binary file\n",
-                 file.depot_path.c_str());
-        else
-          diff_whole(lines, '-');
-      }
-      if(fflush(stdout) < 0)
-        fatal("writing to stdout: %s\n", strerror(errno));
+    // Retrieve all the files that p4 won't diff for us in one go
+    ListDescribe list;
+    list.describe(change.c_str(), "-s");
+    P4Print print;
+    for(size_t n = 0; n < list.files.size(); ++n) {
+      const P4Describe::fileinfo &file = list.files[n];
+      if(file.action == "delete")
+        print.add(p4_decode(file.depot_path), file.rev - 1);
+      else
+        print.add(p4_decode(file.depot_path), file.rev);
     }
+    // p4's own output goes out as it arrives, with the whole files slotted
+    // in as they are printed
+    ShowDescribe description(list.files, print);
+    description.start(change.c_str());
+    print.fetch(&description);
+    description.wait();
+    description.finish();
     return 0;
   }
 
 private:
+  // Drop FILES, or everything below the current directory if FILES is empty,
+  // from the opened-file cache
+  void forget_opened(const vector<string> &files) const {
+    if(dryrun)
+      return;
+    P4OpenedCache cache;
+    if(files.size()) {
+      vector<string> canonical;
+      for(size_t n = 0; n < files.size(); ++n)
+        canonical.push_back(P4OpenedCache::canonical(files[n]));
+      cache.remove(canonical);
+    } else
+      cache.replace(cwd(), vector<string>());
+    cache.save();
+  }
+
   void diff_all() const {
+    // Only open files are of interest, so there's no need for the (possibly
+    // very large) 'p4 have' listing.
     P4Info info;
-    list<string> files;
+    vector<const P4FileInfo *> files;
     info.gather();
-    info.depot_list(files);
-    for(list<string>::const_iterator it = files.begin();
-        it != files.end();
-        ++it) {
-      const string &path = *it;
-      P4FileInfo fi;
-      info.depot_find(path, fi);
-      diff_one(fi);
+    info.all(files, P4Info::Opened|P4Info::Local);
+    // Retrieve the old contents of all deleted files in one go
+    P4Print print;
+    for(size_t n = 0; n < files.size(); ++n)
+      if(files[n]->action == "delete")
+        print.add(files[n]->depot_path);
+    print.fetch();
+    size_t deleted = 0;
+    // Edited files are diffed in batches; other kinds of change interrupt
+    // a batch so that the output stays in order.
+    vector<string> edited;
+    for(size_t n = 0; n < files.size(); ++n) {
+      const P4FileInfo &fi = *files[n];
+      if(fi.action == "edit" || fi.action == "integrate")
+        edited.push_back(fi.depot_path);
+      else if(fi.action == "delete") {
+        diff_edited(edited);
+        diff_deleted(fi, print, deleted++);
+      } else if(fi.action.size()) {
+        diff_edited(edited);
+        diff_one(fi);
+      }
     }
+    diff_edited(edited);
   }
 
-  void diff_one(const string &path) const {
-    P4Info info;
-    list<string> files;
-    info.gather();
-    P4FileInfo fi;
+  // Diff edited files with a single 'p4 diff'.  FILES is emptied.
+  void diff_edited(vector<string> &files) const {
+    if(!files.size())
+      return;
+    execute("p4",
+            EXE_STR, "-x",
+            EXE_STR, "-",
+            EXE_STR, "diff",
+            EXE_STR, "-du",
+            EXE_INPUT|EXE_P4, &files,
+            EXE_END);
+    files.clear();
+    if(fflush(stdout) < 0)
+      fatal("writing to stdout: %s\n", strerror(errno));
+  }
+
+  void diff_one(const P4Info &info, const string &path) const {
+    const P4FileInfo *fi;
     // Any kind of path is accepable
-    if(info.local_find(path, fi))
-      diff_one(fi);
-    else if(info.relative_find(path, fi))
-      diff_one(fi);
-    else if(info.depot_find(path, fi))
-      diff_one(fi);
-    else
+    if((fi = info.local_find(path)))
+      diff_one(*fi);
+    else if((fi = info.relative_find(path)))
+      diff_one(*fi);
+    else if((fi = info.depot_find(path)))
+      diff_one(*fi);
+    else if(isdir(path)) {
+      // Diff everything below a directory.  Its name is put in the same form
+      // as relative_path, so that absolute names and ones involving . or ..
+      // match too.
+      string prefix = path;
+      char *const real = realpath(path.c_str(), NULL);
+      if(real) {
+        const string r = real;
+        free(real);
+        prefix = get_relative_path(r[r.size() - 1] == '/' ? r : r + "/");
+      }
+      if(prefix == "." || prefix == "")
+        prefix = "";
+      else if(prefix[prefix.size() - 1] != '/')
+        prefix += '/';
+      vector<const P4FileInfo *> files;
+      map<string,const P4FileInfo *> below;
+      info.all(files);
+      for(size_t n = 0; n < files.size(); ++n) {
+        const string &relative_path = files[n]->relative_path;
+        // Files outside the current directory have absolute paths
+        if(relative_path.compare(0, prefix.size(), prefix) == 0
+           && (prefix.size() || relative_path[0] != '/'))
+          below[ltfilename::key(relative_path)] = files[n];
+      }
+      for(map<string,const P4FileInfo *>::const_iterator it = below.begin();
+          it != below.end();
+          ++it)
+        diff_one(*it->second);
+    } else
       return;                           // no change, presumably
   }
 
   void diff_one(const P4FileInfo &info) const {
     if(info.action == "edit" || info.action == "integrate") {
       // We can diff the file directly
-      execute("p4",
-              EXE_STR, "diff",
-              EXE_STR, "-du",
-              EXE_STRING|EXE_DOTSTUFF, &info.depot_path,
-              EXE_END);
+      vector<string> files(1, info.depot_path);
+      diff_edited(files);
     } else if(info.action == "branch" || info.action == "add") {
       diff_new(info);
     } else if(info.action == "delete") {
-      diff_deleted(info);
+      P4Print print;
+      print.add(info.depot_path);
+      print.fetch();
+      diff_deleted(info, print, 0);
     }
     // Flush after every file (we're likely to be about to run a subprocess
     // anyway)
@@ -432,42 +833,11 @@ private:
       fatal("writing to stdout: %s\n", strerror(errno));
   }
 
-  void diff_whole(const char *path, char prefix) const {
-    FILE *fp = fopen(path, "r");
-    if(!fp)
-      fatal("error opening %s: %s", path, strerror(errno));
-    int c;
-    long lines = 0;
-    while((c = getc(fp)) != EOF)
-      if(c == '\n')
-        ++lines;
-    writef(stdout, "stdout", prefix == '+' ? "@@ -0,0 +1,%ld @@\n"
-                                           : "@@ -1,%ld +0,0 @@\n",
-           lines);
-    rewind(fp);
-    bool start = true;
-    while((c = getc(fp)) != EOF) {
-      if(start) {
-        writef(stdout, "stdout", "%c", prefix);
-        start = false;
-      }
-      writef(stdout, "stdout", "%c", c);
-      if(c == '\n')
-        start = true;
-    }
-    fclose(fp);
-    if(!start)
-      writef(stdout, "stdout", "\n\\ No newline at end of file\n");
-  }
-
-  void diff_whole(const vector<string> &lines, char prefix) const {
-    writef(stdout, "stdout", prefix == '+' ? "@@ -0,0 +1,%zu @@\n"
-                                           : "@@ -1,%ld +0,0 @@\n",
-           lines.size());
-    for(size_t n = 0; n < lines.size(); ++n)
-      writef(stdout, "stdout", "%c%s", prefix, lines[n].c_str());
-    if(lines.size() && lines.back().find('\n') == string::npos)
-      writef(stdout, "stdout", "\n\\ No newline at end of file\n");
+  // Write file N of PRINT with each line prefixed by PREFIX
+  void diff_whole(const P4Print &print, size_t n, char prefix) const {
+    const P4Print::file &file = print[n];
+    write_whole_diff(stdout, "stdout", print.spool(), prefix,
+                     file.offset, file.size);
   }
 
   void diff_new(const P4FileInfo &info) const {
@@ -478,56 +848,21 @@ private:
     if(info.type == "binary")
       writef(stdout, "stdout", "%s is a binary file\n", info.local_path.c_str());
     else
-      diff_whole(info.local_path.c_str(), '+');
+      write_whole_diff(stdout, "stdout", info.local_path, '+');
   }
 
-  void diff_deleted(const P4FileInfo &info) const {
-    // Deleted file, retrieve the old text with p4 print and print it with a
+  void diff_deleted(const P4FileInfo &info,
+                    const P4Print &print, size_t n) const {
+    // Deleted file, print the old text retrieved with p4 print with a
     // suitable header.  As with diff_new() we write a p4-like header.
-    vector<string> lines;
-    string type;
-    retrieve_file(info.depot_path, lines, &type);
+    const P4Print::file &contents = print[n];
+    if(!contents.found)
+      return;
     writef(stdout, "stdout", "==== %s - ====\n", info.depot_path.c_str());
-    if(type == "binary")
+    if(contents.type == "binary")
       writef(stdout, "stdout", "%s was a binary file\n", info.depot_path.c_str());
     else
-      diff_whole(lines, '-');
-  }
-
-  void retrieve_file(const string &path,
-                     vector<string> &contents,
-                     string *type = NULL,
-                     int rev = -1) const {
-    vector<string> lines;
-    ostringstream s;
-    if(path.size() && path.at(0) == '-')
-      s << "./";
-    s << path;
-    if(rev != -1)
-      s << '#' << rev;
-    int rc;
-    vector<string> command;
-    if((rc = execute(makevs(command,
-                            "p4", "print", s.str().c_str(),
-                            (char *)NULL),
-                     NULL,              // input
-                     &lines,            // output
-                     NULL,              // errors
-                     NULL,              // outputPath
-                     EXE_RAW)))         // flags
-      fatal("p4 print failed with status %d", rc);
-    contents.assign(lines.begin() + 1, lines.end());
-    if(type) {
-      // syntax is:
-      //    //path/to/file#rev - ACTION change CHANGE (TYPE)
-      const string &l = lines[0];
-      string::size_type openb = l.rfind('(');
-      string::size_type closeb = l.rfind(')');
-      if(openb != string::npos && closeb != string::npos)
-        type->assign(l, openb + 1, closeb - (openb + 1));
-      else
-        type->clear();
-    }
+      diff_whole(print, n, '-');
   }
 };
 
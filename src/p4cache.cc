@@ -0,0 +1,422 @@
+/*
+ * This file is part of VCS
+ * Copyright (C) 2026 Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "vcs.h"
+#include "p4utils.h"
+#include <unistd.h>
+#include <sstream>
+
+// The cache file looks like this:
+//
+//   # vcs p4 have cache 1
+//   # PORT CLIENT DIRECTORY
+//   # Change NNN on ...            <- sync state, from 'p4 changes'
+//   # Change NNN on ...
+//   # ... NNN files NNN bytes      <- sync state, from 'p4 sizes -s'
+//   //depot/path#REV - /local/path <- 'p4 have ...' output, verbatim
+//   ...
+//
+// The sync state is the most recent change we have any file from, the most
+// recent change submitted from this client, and the number and total size of
+// the files we have.  Between them they catch most changes to the have list
+// but not all of them: 'p4 sync -k' or 'p4 flush' to a revision of the same
+// size, for instance, leaves them all alone.  That is why the cache is only
+// used if VCS_P4_HAVE_CACHE is set, i.e. by people who sync through 'vcs
+// update', which keeps the cache exact.
+static const char cache_magic[] = "# vcs p4 have cache 1";
+
+// Return the path to the cache file for KEY, or "" if there is nowhere to
+// put it
+static string cache_file(const char *prefix, const string &key) {
+  const string dir = cache_directory();
+  if(!dir.size())
+    return "";
+  // FNV-1a, just to get a reasonably short filename.  The full key is
+  // recorded in the file too.
+  unsigned long long h = 14695981039346656037ULL;
+  for(size_t n = 0; n < key.size(); ++n) {
+    h ^= (unsigned char)key[n];
+    h *= 1099511628211ULL;
+  }
+  ostringstream s;
+  s << dir << PATHSEPSTR << prefix << hex << h;
+  return s.str();
+}
+
+// Atomically replace PATH with HEADER followed by LINES (or the raw
+// contents of BUFFER).  Caching is best-effort so failure is silent.
+static void write_cache(const string &path, const string &header,
+                        const vector<string> *lines,
+                        const LineBuffer *buffer = NULL) {
+  ostringstream s;
+  s << path << ".new." << getpid();
+  const string tmp = s.str();
+  FILE *fp = fopen(tmp.c_str(), "w");
+  if(!fp)
+    return;
+  bool ok = fprintf(fp, "%s\n", header.c_str()) >= 0;
+  for(size_t n = 0; ok && lines && n < lines->size(); ++n)
+    ok = fprintf(fp, "%s\n", (*lines)[n].c_str()) >= 0;
+  if(ok && buffer && buffer->size())
+    ok = fwrite(buffer->data(), 1, buffer->size(), fp) == buffer->size();
+  if(fclose(fp) < 0)
+    ok = false;
+  if(!ok || rename(tmp.c_str(), path.c_str()) < 0)
+    ::remove(tmp.c_str());
+}
+
+P4HaveCache::P4HaveCache(): checked(false) {
+  const char *client = getenv("P4CLIENT");
+  if(!client || !*client || !getenv("VCS_P4_HAVE_CACHE"))
+    return;
+  const char *port = getenv("P4PORT");
+  key = string(port ? port : "") + " " + client + " " + cwd();
+  path = cache_file("p4have-", key);
+}
+
+P4HaveCache::~P4HaveCache() {
+}
+
+bool P4HaveCache::exists() const {
+  return usable() && ::exists(path);
+}
+
+void P4HaveCache::check() {
+  vector<string> command;
+
+  if(checked || latest.running())
+    return;
+  const string client = getenv("P4CLIENT");
+  latest.start(makevs(command, "p4", "changes", "-m1", "...#have",
+                      (char *)0));
+  submitted.start(makevs(command, "p4", "changes", "-m1", "-s", "submitted",
+                         "-c", client.c_str(), (char *)0));
+  sizes.start(makevs(command, "p4", "sizes", "-s", "...#have", (char *)0));
+}
+
+void P4HaveCache::wait_check() {
+  if(checked)
+    return;
+  check();
+  const int rc1 = latest.wait(), rc2 = submitted.wait(), rc3 = sizes.wait();
+  checked = true;
+  state.clear();
+  if(rc1 || rc2 || rc3
+     || latest.errors.size() || submitted.errors.size() || sizes.errors.size()
+     || sizes.output.size() != 1)
+    return;                             // leave the state unknown
+  state = "# " + (latest.output.size() ? latest.output[0] : string("none"));
+  state += "\n# ";
+  state += submitted.output.size() ? submitted.output[0] : string("none");
+  state += "\n# " + sizes.output[0];
+}
+
+void P4HaveCache::reset() {
+  if(latest.running())
+    wait_check();
+  checked = false;
+  state.clear();
+}
+
+bool P4HaveCache::load(string &old_state, LineBuffer &lines) const {
+  FILE *fp = fopen(path.c_str(), "r");
+  if(!fp)
+    return false;
+  string l;
+  bool ok = (readline(path, fp, l) && l == cache_magic
+             && readline(path, fp, l) && l == "# " + key);
+  old_state.clear();
+  lines.clear();
+  while(ok && readline(path, fp, l)) {
+    if(l.size() && l[0] == '#') {
+      if(old_state.size())
+        old_state += "\n";
+      old_state += l;
+    } else {
+      lines.append(l.data(), l.size());
+      lines.append("\n", 1);
+    }
+  }
+  fclose(fp);
+  return ok;
+}
+
+bool P4HaveCache::fresh(LineBuffer &lines) {
+  string old_state;
+  wait_check();
+  if(!state.size() || !load(old_state, lines))
+    return false;
+  if(old_state != state) {
+    if(debug)
+      fprintf(stderr, "%s is stale\n", path.c_str());
+    lines.clear();
+    return false;
+  }
+  if(debug)
+    fprintf(stderr, "using %s\n", path.c_str());
+  return true;
+}
+
+void P4HaveCache::save(const vector<string> &lines) {
+  save(&lines, NULL);
+}
+
+void P4HaveCache::save(const LineBuffer &lines) {
+  save(NULL, &lines);
+}
+
+void P4HaveCache::save(const vector<string> *lines, const LineBuffer *buffer) {
+  if(!usable())
+    return;
+  wait_check();
+  if(!state.size()) {
+    // Sync state unknown, so the cache would be unverifiable
+    ::remove(path.c_str());
+    return;
+  }
+  write_cache(path, string(cache_magic) + "\n# " + key + "\n" + state,
+              lines, buffer);
+}
+
+// 'p4 sync' output is:
+//   //depot/path#REV - updating /local/path
+//   //depot/path#REV - added as /local/path
+//   //depot/path#REV - refreshing /local/path
+//   //depot/path#REV - replacing /local/path
+//   //depot/path#REV - deleted as /local/path
+// ...plus other things (e.g. about open files) that don't affect the have
+// list.
+void P4HaveCache::update(const vector<string> &sync) {
+  static const char *const verbs[] = {
+    "updating ", "added as ", "refreshing ", "replacing ",
+  };
+  static const char deleted[] = "deleted as ";
+  string old_state;
+  LineBuffer old(LineBuffer::large);
+
+  if(!exists() || !load(old_state, old))
+    return;
+  old.finish();
+  // Index the old have list by (encoded) depot path
+  map<string,string> have;
+  size_t pos = 0;
+  LineSpan span;
+  while(old.next(pos, span)) {
+    const string l = span.str();
+    have[l.substr(0, l.find('#'))] = l;
+  }
+  for(size_t n = 0; n < sync.size(); ++n) {
+    const string &l = sync[n];
+    const string::size_type hash = l.find('#');
+    const string::size_type dash = l.find(" - ", hash);
+    if(l.compare(0, 2, "//") != 0
+       || hash == string::npos
+       || dash == string::npos)
+      continue;
+    const string depot_path(l, 0, hash);
+    const string::size_type action = dash + 3;
+    if(l.compare(action, sizeof deleted - 1, deleted) == 0) {
+      have.erase(depot_path);
+      continue;
+    }
+    for(size_t m = 0; m < sizeof verbs / sizeof *verbs; ++m) {
+      const size_t len = strlen(verbs[m]);
+      if(l.compare(action, len, verbs[m]) == 0) {
+        have[depot_path] = l.substr(0, dash) + " - " + l.substr(action + len);
+        break;
+      }
+    }
+  }
+  vector<string> lines;
+  for(map<string,string>::const_iterator it = have.begin();
+      it != have.end();
+      ++it)
+    lines.push_back(it->second);
+  reset();
+  save(lines);
+}
+
+// P4OpenedCache --------------------------------------------------------------
+
+// The cache file looks like this:
+//
+//   # vcs p4 opened cache 1
+//   # PORT CLIENT
+//   /local/path                        <- one line per open file
+//   ...
+//
+// It is updated by the commands that open, revert or submit files, and
+// refreshed from 'p4 opened' whenever 'vcs status' runs.  Anything else that
+// happens to the client (e.g. plain 'p4 revert') can make it wrong.  'vcs
+// edit' only trusts an entry if the file is writable too, which p4 ensures
+// it isn't after a revert, except on allwrite clients or for +w filetypes.
+//
+// Paths are canonical (see P4OpenedCache::canonical()) so that the same file
+// always has the same entry however it was named.
+static const char opened_magic[] = "# vcs p4 opened cache 1";
+
+P4OpenedCache::P4OpenedCache(): dirty(false) {
+  const char *client = getenv("P4CLIENT");
+  if(!client || !*client)
+    return;
+  const char *port = getenv("P4PORT");
+  key = string(port ? port : "") + " " + client;
+  if(!(path = cache_file("p4opened-", key)).size())
+    return;
+  FILE *fp = fopen(path.c_str(), "r");
+  if(!fp)
+    return;
+  string l;
+  if(readline(path, fp, l) && l == opened_magic
+     && readline(path, fp, l) && l == "# " + key) {
+    while(readline(path, fp, l))
+      opened.insert(l);
+  }
+  fclose(fp);
+}
+
+bool P4OpenedCache::contains(const string &p) const {
+  return opened.find(p) != opened.end();
+}
+
+void P4OpenedCache::add(const vector<string> &paths) {
+  for(size_t n = 0; n < paths.size(); ++n)
+    if(opened.insert(paths[n]).second)
+      dirty = true;
+}
+
+void P4OpenedCache::remove(const vector<string> &paths) {
+  for(size_t n = 0; n < paths.size(); ++n)
+    if(opened.erase(paths[n]))
+      dirty = true;
+}
+
+void P4OpenedCache::replace(const string &dir,
+                            const vector<string> &paths) {
+  const string prefix = dir == "/" ? dir : dir + "/";
+  set<string>::iterator it = opened.lower_bound(prefix);
+  while(it != opened.end() && it->compare(0, prefix.size(), prefix) == 0)
+    opened.erase(it++);
+  opened.insert(paths.begin(), paths.end());
+  dirty = true;
+}
+
+void P4OpenedCache::save() {
+  if(!dirty || !path.size())
+    return;
+  vector<string> lines(opened.begin(), opened.end());
+  write_cache(path, string(opened_magic) + "\n# " + key, &lines);
+  dirty = false;
+}
+
+string P4OpenedCache::canonical(const string &p) {
+  string dir = p.size() && p[0] == '/' ? p : cwd() + "/" + p;
+  const string base = basename_(dir);
+  dir = parentdir(dir);
+  char *const real = realpath(dir.c_str(), NULL);
+  if(real) {
+    dir = real;
+    free(real);
+  }
+  return dir == "/" ? dir + base : dir + "/" + base;
+}
+
+// P4ClientView cache ---------------------------------------------------------
+
+// The cache file looks like this:
+//
+//   # vcs p4 view cache 1
+//   # PORT CLIENT
+//   /client/root
+//   insensitive                        <- case handling, maybe empty
+//   +w prefix                          <- one line per rule: include (+) or
+//   -p prefix                             exclude (-), whole (w) or partial
+//   ...
+//
+// It is written whenever the view is compiled and checked against the
+// server after every use.
+static const char view_magic[] = "# vcs p4 view cache 1";
+
+// Return the cache file for the current client and its key, or "" if there
+// isn't one
+static string view_cache_file(string &key) {
+  const char *client = getenv("P4CLIENT");
+  if(!client || !*client)
+    return "";
+  const char *port = getenv("P4PORT");
+  key = string(port ? port : "") + " " + client;
+  return cache_file("p4view-", key);
+}
+
+bool P4ClientView::load_cache() {
+  string key;
+  const string path = view_cache_file(key);
+  if(!path.size())
+    return false;
+  FILE *fp = fopen(path.c_str(), "r");
+  if(!fp)
+    return false;
+  string l;
+  bool ok = (readline(path, fp, l) && l == view_magic
+             && readline(path, fp, l) && l == "# " + key
+             && readline(path, fp, compiled_view.root)
+             && readline(path, fp, compiled_view.case_handling));
+  compiled_view.rules.clear();
+  while(ok && readline(path, fp, l)) {
+    rule r;
+    if(l.size() < 3 || (l[0] != '+' && l[0] != '-')
+       || (l[1] != 'w' && l[1] != 'p') || l[2] != ' ') {
+      ok = false;
+      break;
+    }
+    r.exclude = (l[0] == '-');
+    r.whole = (l[1] == 'w');
+    r.prefix = l.substr(3);
+    compiled_view.rules.push_back(r);
+  }
+  fclose(fp);
+  return ok && compiled_view.root.size() && compiled_view.root[0] == '/';
+}
+
+void P4ClientView::save_cache(const compiled *c) const {
+  string key;
+  const string path = view_cache_file(key);
+  if(!path.size())
+    return;
+  if(!c) {
+    ::remove(path.c_str());
+    return;
+  }
+  vector<string> lines;
+  lines.push_back(c->root);
+  lines.push_back(c->case_handling);
+  for(size_t n = 0; n < c->rules.size(); ++n) {
+    const rule &r = c->rules[n];
+    lines.push_back(string(r.exclude ? "-" : "+") + (r.whole ? "w " : "p ")
+                    + r.prefix);
+  }
+  write_cache(path, string(view_magic) + "\n# " + key, &lines);
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,212 @@
+/*
+ * This file is part of VCS
+ * Copyright (C) 2026 Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "vcs.h"
+#include "p4utils.h"
+#include <sstream>
+#include <algorithm>
+
+// 'p4 print' writes each file as a header line:
+//
+//   //depot/path#REV - ACTION change CHANGE (TYPE)
+//
+// followed by the contents.  If a text file lacks a final newline then the
+// next header follows its last line directly, so headers are recognized at
+// the end of a line as well as at the start.  Files come back in the order
+// they were asked for, so the only header accepted is the one for the next
+// file expected.  A file that can't be printed produces an error of the form
+//
+//   //depot/path#REV - MESSAGE
+//
+// instead, and then the file after it is expected.  Errors arrive separately
+// from the output, but no later than the output that follows them, so they
+// may be ahead of it but are never behind.  (Nothing can tell a line that
+// looks exactly like the next file's header from the real thing.)
+//
+// The output is parsed as it arrives and only file contents are written to
+// the spool, so memory use is bounded however large the files are.
+
+// How much of the end of each line to keep for header recognition
+static const size_t tail_max = 8192;
+
+// The contents of binary files are never shown, so aren't worth keeping
+static bool discard(const P4Print::file &f) {
+  return f.type == "binary";
+}
+
+P4Print::P4Print(): fp(NULL), expected(0), next_error(0), next_spec(0),
+                    progress(NULL) {
+}
+
+P4Print::~P4Print() {
+  if(fp)
+    fclose(fp);
+}
+
+size_t P4Print::add(const string &depot_path, int rev) {
+  file f;
+  f.depot_path = depot_path;
+  f.rev = rev;
+  files.push_back(f);
+  return files.size() - 1;
+}
+
+void P4Print::fetch(P4PrintProgress *progress_) {
+  if(!files.size())
+    return;
+  progress = progress_;
+  // Pass filenames on stdin to avoid any command line length limit.  They
+  // are generated as p4 reads them.
+  vector<string> command;
+  expected = next_error = next_spec = 0;
+  failed.assign(files.size(), false);
+  if(!(fp = fopen(tmp.c_str(), "w")))
+    fatal("error opening %s: %s", tmp.c_str(), strerror(errno));
+  // The output is parsed as it arrives
+  current = NULL;
+  tail.clear();
+  offset = start = spooled = 0;
+  const int rc = execute(makevs(command, "p4", "-x", "-", "print",
+                                (char *)NULL),
+                         *(LineSource *)this, *(ChunkSink *)this,
+                         *(LineSink *)this);
+  // p4 exits nonzero if any file couldn't be printed.  That has already
+  // been reported, and the file is left not found; only a failure that
+  // isn't about any particular file is fatal.
+  if(rc && find(failed.begin(), failed.end(), true) == failed.end())
+    fatal("p4 print failed with status %d", rc);
+  if(start < offset)
+    check_header(offset, false);
+  if(current)
+    current->size = offset - start_contents;
+  if(fclose(fp) < 0)
+    fatal("error writing %s: %s", tmp.c_str(), strerror(errno));
+  fp = NULL;
+  if(progress)
+    progress->printed(files.size());
+  progress = NULL;
+}
+
+// Called for each file to ask for
+bool P4Print::next(string &l) {
+  if(next_spec >= files.size())
+    return false;
+  const file &f = files[next_spec++];
+  ostringstream s;
+  s << p4_encode(f.depot_path);
+  if(f.rev != -1)
+    s << '#' << f.rev;
+  l = s.str();
+  return true;
+}
+
+// Called with each block of 'p4 print' output
+void P4Print::chunk(const char *ptr, size_t n) {
+  const char *const end = ptr + n;
+  while(ptr < end) {
+    const char *nl = (const char *)memchr(ptr, '\n', end - ptr);
+    const char *stop = nl ? nl + 1 : end;
+    // Whatever precedes a header belongs to the file before it
+    if(current && !discard(*current)) {
+      if(fwrite(ptr, 1, stop - ptr, fp) != (size_t)(stop - ptr))
+        fatal("error writing %s: %s", tmp.c_str(), strerror(errno));
+      spooled += stop - ptr;
+    }
+    tail.append(ptr, nl ? nl : end);
+    if(tail.size() > tail_max)
+      tail.erase(0, tail.size() - tail_max);
+    offset += stop - ptr;
+    ptr = stop;
+    if(nl) {
+      check_header(offset, true);
+      tail.clear();
+      start = offset;
+    }
+  }
+}
+
+// Called with each line of errors from 'p4 print'.  They are passed on to
+// the user.
+void P4Print::line(const string &l) {
+  writef(stderr, "stderr", "%s\n", l.c_str());
+  const string::size_type dash = l.find(" - ");
+  if(dash == string::npos)
+    return;
+  const string spec(l, 0, dash);
+  const string depot_path = p4_decode(spec.substr(0, spec.find('#')));
+  for(size_t n = next_error; n < files.size(); ++n) {
+    if(files[n].depot_path == depot_path) {
+      failed[n] = true;
+      next_error = n + 1;
+      break;
+    }
+  }
+}
+
+// Process one line ending at END.  TAIL is the end of the line, without any
+// newline.
+void P4Print::check_header(off_t end, bool newline) {
+  while(expected < files.size() && failed[expected])
+    ++expected;
+  const string::size_type h = tail.rfind("//");
+  if(expected < files.size()
+     && h != string::npos && tail.size() && tail[tail.size() - 1] == ')') {
+    // Might be a header
+    const string::size_type hash = tail.find('#', h);
+    const string::size_type dash = tail.find(" - ", h);
+    const string::size_type openb = tail.rfind('(');
+    // A truncated escape can't be part of a header
+    string::size_type pct = tail.find('%', h);
+    while(pct < hash && pct + 2 < hash)
+      pct = tail.find('%', pct + 3);
+    if(hash != string::npos && dash != string::npos && hash < dash
+       && openb != string::npos && openb > dash
+       && (pct == string::npos || pct > hash)) {
+      // p4 may not use the same case for hex digits as we do, so compare
+      // decoded paths
+      const string depot_path = p4_decode(string(tail, h, hash - h));
+      const int rev = atoi(tail.c_str() + hash + 1);
+      const file &want = files[expected];
+      if(depot_path == want.depot_path
+         && (want.rev == -1 || want.rev == rev)) {
+        const off_t header = end - (newline ? 1 : 0) - (tail.size() - h);
+        if(current)
+          current->size = header - start_contents;
+        current = &files[expected++];
+        current->found = true;
+        current->type.assign(tail, openb + 1, tail.size() - 1 - (openb + 1));
+        current->offset = spooled;
+        start_contents = end;
+        // Everything before this file is complete
+        if(progress) {
+          if(fflush(fp) < 0)
+            fatal("error writing %s: %s", tmp.c_str(), strerror(errno));
+          progress->printed(expected - 1);
+        }
+      }
+    }
+  }
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
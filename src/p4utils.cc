@@ -18,89 +18,117 @@
 #include "vcs.h"
 #include "p4utils.h"
 #include <unistd.h>
-#include <sstream>
-#include <iomanip>
+#include <stdint.h>
 #include <stdexcept>
+#include <algorithm>
 
-extern "C" {
-  extern char **environ;
+/* "To refer to files containing the Perforce revision specifier wildcards (@
+ * and #), file matching wildcard (*), or positional substitution wildcard
+ * (%%) in either the file name or any directory component, use the ASCII
+ * expression of the character's hexadecimal value. ASCII expansion applies
+ * only to the following four characters" - and it mentions @, #, *, %.  What
+ * you're supposed to do for spaces in filenames I do not know!
+ *
+ * Most paths contain none of these, so both directions first scan for them
+ * a word at a time and return the input unchanged if there are none.
+ */
+
+// Nonzero in each byte of X that is zero (and possibly the byte above it)
+static inline uint64_t zero_bytes(uint64_t x) {
+  return (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
 }
 
-// Replace metacharacters with %xx
-string p4_encode(const string &s) {
-  ostringstream r;
-  string::size_type n;
-
-  /* "To refer to files containing the Perforce revision specifier wildcards (@
-   * and #), file matching wildcard (*), or positional substitution wildcard
-   * (%%) in either the file name or any directory component, use the ASCII
-   * expression of the character's hexadecimal value. ASCII expansion applies
-   * only to the following four characters" - and it mentions @, #, *, %.  What
-   * you're supposed to do for spaces in filenames I do not know!
-   */
-  r << hex;
-  for(n = 0; n < s.size(); ++n)
-    switch(s[n]) {
+// Return the position of the first metacharacter in S at or after POS, or
+// npos
+static string::size_type find_meta(const string &s, string::size_type pos) {
+  const char *const base = s.data();
+  const string::size_type size = s.size();
+  while(pos + 8 <= size) {
+    uint64_t w;
+    memcpy(&w, base + pos, 8);
+    if(zero_bytes(w ^ 0x4040404040404040ULL)   // @
+       | zero_bytes(w ^ 0x2323232323232323ULL) // #
+       | zero_bytes(w ^ 0x2a2a2a2a2a2a2a2aULL) // *
+       | zero_bytes(w ^ 0x2525252525252525ULL)) // %
+      break;
+    pos += 8;
+  }
+  for(; pos < size; ++pos)
+    switch(base[pos]) {
     case '@':
     case '#':
     case '*':
     case '%':
-      r << "%" << setw(2) << setfill('0') << (int)s[n];
-      break;
-    default:
-      r << s[n];
-      break;
+      return pos;
     }
-  return r.str();
+  return string::npos;
+}
+
+// Replace metacharacters with %xx
+string p4_encode(const string &s) {
+  string::size_type n = find_meta(s, 0);
+  if(n == string::npos)
+    return s;
+  // Count the escapes so the result can be built in place
+  size_t count = 0;
+  for(string::size_type m = n; m != string::npos; m = find_meta(s, m + 1))
+    ++count;
+  static const char hexdigits[] = "0123456789abcdef";
+  string r(s.size() + 2 * count, 0);
+  memcpy(&r[0], s.data(), n);
+  char *out = &r[n];
+  for(; n < s.size(); ++n) {
+    const unsigned char c = s[n];
+    if(c == '@' || c == '#' || c == '*' || c == '%') {
+      *out++ = '%';
+      *out++ = hexdigits[c >> 4];
+      *out++ = hexdigits[c & 15];
+    } else
+      *out++ = c;
+  }
+  return r;
 }
 
 // Replace metacharacters in multiple filesnames
 vector<string> p4_encode(const vector<string> &files) {
   vector<string> newfiles;
+  newfiles.reserve(files.size());
   for(size_t n = 0; n < files.size(); ++n)
     newfiles.push_back(p4_encode(files[n]));
   return newfiles;
 }
 
-static int fromhex(int c) {
-  switch(c) {
-  case '0': return 0;
-  case '1': return 1;
-  case '2': return 2;
-  case '3': return 3;
-  case '4': return 4;
-  case '5': return 5;
-  case '6': return 6;
-  case '7': return 7;
-  case '8': return 8;
-  case '9': return 9;
-  case 'a': return 10;
-  case 'b': return 11;
-  case 'c': return 12;
-  case 'd': return 13;
-  case 'e': return 14;
-  case 'f': return 15;
-  case 'A': return 10;
-  case 'B': return 11;
-  case 'C': return 12;
-  case 'D': return 13;
-  case 'E': return 14;
-  case 'F': return 15;
-  default: return 0;
-  }
-}
+// Value of each hex digit; anything else counts as 0
+static const unsigned char hexvalue[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 0, 0, 0, 0, 0, 0, // 0-9
+  0, 10, 11, 12, 13, 14, 15, 0, 0, 0, 0, 0, 0, 0, 0, 0, // A-F
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 10, 11, 12, 13, 14, 15, 0, 0, 0, 0, 0, 0, 0, 0, 0, // a-f
+};
 
 static string p4_decode_raw(const string &s) {
+  // memchr() is already vectorized
+  const char *const base = s.data();
+  const char *pct = (const char *)memchr(base, '%', s.size());
+  if(!pct)
+    return s;
   string r;
-  string::size_type n;
-
-  for(n = 0; n < s.size(); ++n) {
-    if(s[n] == '%') {
-      r += 16 * fromhex(s.at(n + 1)) + fromhex(s.at(n + 2));
-      n += 2;
-    } else
-      r += s[n];
+  r.reserve(s.size());
+  string::size_type n = 0;
+  while(pct) {
+    const string::size_type m = pct - base;
+    if(m + 2 >= s.size())
+      throw out_of_range("p4_decode");
+    r.append(base + n, m - n);
+    r += (char)(16 * hexvalue[(unsigned char)s[m + 1]]
+                + hexvalue[(unsigned char)s[m + 2]]);
+    n = m + 3;
+    pct = (const char *)memchr(base + n, '%', s.size() - n);
   }
+  r.append(base + n, s.size() - n);
   return r;
 }
 
@@ -121,101 +149,78 @@ string p4_decode(const string &s) {
 // Commands chapter in the Perforce user guide) then they are preserved in the
 // first two but are replaced by their expansion (which might be a space) in
 // the third.
-void P4Where::parse(const string &l) {
+void P4Where::parse(const LineSpan &l) {
   string::size_type n = l.find(' ');
-  depot_path = p4_decode(l.substr(0, n));
+  depot_path = p4_decode(l.substr(0, n).str());
   string::size_type m = n + 1;
   n = l.find(' ', m);
-  view_path = p4_decode(l.substr(m, n - m));
+  view_path = p4_decode(l.substr(m, n - m).str());
   m = n + 1;
-  local_path.assign(l, m, string::npos); // not encoded!
+  const LineSpan local = l.substr(m);   // not encoded!
+  local_path.assign(local.ptr, local.len);
 }
 
-// Compute the number of bytes required for the environment
-static size_t env_size() {
-  char **e = environ;
-  size_t size = 1;
-  while(*e)
-    size += strlen(*e++) + 1;
-  return size;
-}
+// Encode filenames for p4 as it reads them
+class EncodeSource: public LineSource {
+public:
+  EncodeSource(const list<string> &files): it(files.begin()),
+                                           end(files.end()) {
+  }
 
-// Run 'p4 where' on all the listed files, breaking up into multiple
-// invocations to avoid command-line length limits.
-void p4__where(vector<string> &where, const list<string> &files) {
-  where.clear();
+  bool next(string &l) {
+    if(it == end)
+      return false;
+    l = p4_encode(*it++);
+    return true;
+  }
 
-  // Figure out how much space we can safely use for the command line
-  size_t limit = sysconf(_SC_ARG_MAX) - 2048;
-  const size_t e = env_size();
-  if(e >= limit)
-    fatal("no space for commands - e=%lu, limit=%lu",
-          (unsigned long)e, (unsigned long)limit);
-  limit -= e;
-  // ARG_MAX is the system limit.  Should be at least 4096.  2048 is clearance
-  // for the subprocess to modify its own environment and a few bytes for the
-  // 'p4 where'.  We subtract the size of the current environment too.
-  //
-  // http://www.in-ulm.de/~mascheck/various/argmax/
-
-  list<string>::const_iterator it = files.begin();
-  while(it != files.end()) {
-    // Find the next few kilobytes worth of filenames
-    list<string>::const_iterator e = it;
-    vector<string> cmd;
-    cmd.push_back("p4");
-    cmd.push_back("where");
-    size_t total = 0;
-    while(e != files.end()) {
-      const string encoded = p4_encode(*e);
-      size_t here = encoded.size() + 1;
-
-      if(total + here > limit)
-        break;
-      cmd.push_back(encoded);
-      total += here;
-      ++e;
-    }
-    if(e == it)
-      fatal("filename too long: %s", it->c_str());
-    vector<string> someresults, errors;
-    int rc;
-    if((rc = execute(cmd, NULL/*input*/, &someresults, &errors))) {
-      report_lines(errors);
-      fatal("'p4 where PATHS' exited with status %d", rc);
-    }
-    size_t n;
-    for(n = 0; n < errors.size(); ++n) {
-      if(errors[n].find(" - file(s) not in client view.") == string::npos)
-        break;
-    }
-    if(n < errors.size()) {
-      report_lines(errors);
-      fatal("Unexpected error output from 'p4 where PATHS'");
-    }
-    while(someresults.size()
-          && someresults.back().size() == 0)
-      someresults.pop_back();
-    where.insert(where.end(), someresults.begin(), someresults.end());
-    it = e;
+private:
+  list<string>::const_iterator it, end;
+};
+
+// Run 'p4 where' on all the listed files.  They are passed on standard
+// input, so there is no limit on how many there can be.
+void p4__where(LineBuffer &where, const list<string> &files) {
+  where.clear();
+  if(!files.size())
+    return;
+  vector<string> cmd, errors;
+  EncodeSource input(files);
+  int rc;
+  if((rc = execute(makevs(cmd, "p4", "-x", "-", "where", (char *)NULL),
+                   input, where, &errors))) {
+    report_lines(errors);
+    fatal("'p4 where PATHS' exited with status %d", rc);
+  }
+  size_t n;
+  for(n = 0; n < errors.size(); ++n) {
+    if(errors[n].find(" - file(s) not in client view.") == string::npos)
+      break;
+  }
+  if(n < errors.size()) {
+    report_lines(errors);
+    fatal("Unexpected error output from 'p4 where PATHS'");
   }
 }
 
-// Run 'p4 where' on all the listed files,  breaking up into multiple
-// invocations to avoid command-line length limits and returning the
-// results index by depot path, view path and local path.
+// Run 'p4 where' on all the listed files, returning the results indexed by
+// depot path, view path and local path.
 void p4__where(const list<string> &files,
                map<string,P4Where> &depot,
                map<string,P4Where> &view,
                map<string,P4Where> &local) {
-  vector<string> where;
+  LineBuffer where;
+  size_t pos = 0;
+  LineSpan l;
 
   p4__where(where, files);
   depot.clear();
   view.clear();
   local.clear();
-  for(size_t n = 0; n < where.size(); ++n) {
-    P4Where w(where[n]);
+  while(where.next(pos, l)) {
+    if(!l.size())
+      continue;
+    P4Where w(l);
 
     //fprintf(stderr, "local %s\n", w.local_path.c_str());
     depot.insert(pair<string,P4Where>(w.depot_path, w));
@@ -224,6 +229,30 @@ void p4__where(const list<string> &files,
   }
 }
 
+// Return true if every line of ERRORS is one of the harmless complaints p4
+// makes about arguments that match nothing
+static bool benign_errors(const vector<string> &errors) {
+  static const char *const benign[] = {
+    " - file(s) not opened on this client.",
+    " - file(s) not on client.",
+    " - file(s) not in client view.",
+    " - no such file(s).",
+    " - no file(s) to resolve.",
+  };
+  for(size_t n = 0; n < errors.size(); ++n) {
+    const string &e = errors[n];
+    size_t m;
+    for(m = 0; m < sizeof benign / sizeof *benign; ++m) {
+      const size_t len = strlen(benign[m]);
+      if(e.size() >= len && e.compare(e.size() - len, len, benign[m]) == 0)
+        break;
+    }
+    if(m >= sizeof benign / sizeof *benign)
+      return false;
+  }
+  return true;
+}
+
 // P4FileInfo ------------------------------------------------------------------
 
 P4FileInfo::P4FileInfo(): rev(-1), chnum(0), locked(false),
@@ -295,254 +324,672 @@ P4FileInfo::~P4FileInfo() {
 
 void P4FileInfo::get(map<string,P4FileInfo> &results,
                      const char *pattern) {
+  vector<string> command;
+  AsyncCommand opened;
+  P4OpenedSink sink;
+
+  opened.start(makevs(command, "p4", "opened", pattern, (char *)0), sink);
+  get(results, opened, sink);
+}
+
+void P4FileInfo::get(map<string,P4FileInfo> &results,
+                     AsyncCommand &opened,
+                     P4OpenedSink &sink) {
   int rc;
-  vector<string> command, opened, errors;
 
   results.clear();
-  if((rc = execute(makevs(command, "p4", "opened", pattern, (char *)0),
-                   NULL/*input*/,
-                   &opened,
-                   &errors))) {
-    report_lines(errors);
+  if((rc = opened.wait())) {
+    report_lines(opened.errors);
     fatal("'p4 opened ...' exited with status %d", rc);
   }
-  if(!(errors.size() == 0
-       || (errors.size() == 1
-           && errors[0] == "... - file(s) not opened on this client."))) {
-    report_lines(errors);
+  if(!benign_errors(opened.errors)) {
+    report_lines(opened.errors);
     fatal("Unexpected error output from 'p4 opened ...'");
   }
-  for(size_t n = 0; n < opened.size(); ++n) {
-    P4FileInfo fi(opened[n]);
-    results[fi.depot_path] = fi;
+  results.swap(sink.results);
+  sink.results.clear();
+}
+
+void P4OpenedSink::line(const string &l) {
+  P4FileInfo fi(l);
+  results[fi.depot_path] = fi;
+}
+
+// 'p4 have' gives all files, in the form:
+//   DEPOT-PATH#REV - LOCAL-PATH
+void P4HaveSink::line(const string &l) {
+  lines.append(l.data(), l.size());
+  lines.append("\n", 1);
+}
+
+void P4HaveSink::clear() {
+  lines.clear();
+}
+
+// 'p4 -ztag fstat' gives one record per file, separated by blank lines:
+//   ... depotFile //depot/path
+//   ... clientFile /local/path
+//   ... haveRev 3
+//   ... action edit
+//   ... change default
+//   ... type text
+//   ... unresolved
+// ...and various other fields we don't care about.
+P4FstatSink::P4FstatSink(): on_client(false) {
+}
+
+void P4FstatSink::line(const string &l) {
+  const size_t len = l.size();
+  if(len < 5 || l.compare(0, 4, "... ") != 0) {
+    // End of a record
+    finish();
+    return;
   }
+  string::size_type key = 4, value = l.find(' ', key);
+  if(value == string::npos)
+    value = len;
+  const size_t keylen = value - key;
+  if(value < len)
+    ++value;
+#define FIELD(NAME) \
+  (keylen == sizeof NAME - 1 && l.compare(key, keylen, NAME) == 0)
+  if(FIELD("depotFile")) {
+    // Records are normally blank-line separated but don't rely on it
+    finish();
+    fi.depot_path.assign(p4_decode(l.substr(value)));
+  } else if(FIELD("clientFile"))
+    fi.local_path.assign(l, value, string::npos);
+  else if(FIELD("haveRev")) {
+    fi.rev = atoi(l.c_str() + value);
+    on_client = true;
+  } else if(FIELD("workRev")) {
+    if(fi.rev < 0)
+      fi.rev = atoi(l.c_str() + value);
+  } else if(FIELD("action")) {
+    fi.action.assign(l, value, string::npos);
+    on_client = true;
+  } else if(FIELD("change")) {
+    if(l.compare(value, string::npos, "default") == 0)
+      fi.chnum = -1;
+    else
+      fi.chnum = atoi(l.c_str() + value);
+  } else if(FIELD("type"))
+    fi.type.assign(l, value, string::npos);
+  else if(FIELD("unresolved"))
+    fi.resolvable = true;
+  else if(FIELD("ourLock"))
+    fi.locked = true;
+#undef FIELD
 }
 
-// P4Info ----------------------------------------------------------------------
+void P4FstatSink::finish() {
+  if(on_client && fi.depot_path.size())
+    records.push_back(fi);
+  fi = P4FileInfo();
+  on_client = false;
+}
 
-P4Info::P4Info() {
+void P4FstatSink::clear() {
+  records.clear();
+  fi = P4FileInfo();
+  on_client = false;
 }
 
-P4Info::~P4Info() {
+// P4PathIndex -----------------------------------------------------------------
+
+// Open addressing with linear probing, kept at most half full
+
+P4PathIndex::P4PathIndex(string P4FileInfo::*field_): field(field_), used(0) {
 }
 
-bool P4Info::depot_find(const string &depot_path, P4FileInfo &fi) const {
-  info_type::const_iterator it = info.find(depot_path);
+// FNV-1a
+static size_t hash_path(const string &s) {
+  size_t h = 2166136261u;
+  for(string::size_type n = 0; n < s.size(); ++n) {
+    h ^= (unsigned char)s[n];
+    h *= 16777619u;
+  }
+  return h;
+}
 
-  if(it != info.end()) {
-    fi = it->second;
-    return true;
-  } else
-    return false;
+size_t P4PathIndex::find(const table_type &table, const string &key) const {
+  if(!slots.size())
+    return npos;
+  const size_t mask = slots.size() - 1;
+  for(size_t h = hash_path(key) & mask; slots[h]; h = (h + 1) & mask)
+    if(table[slots[h] - 1].*field == key)
+      return slots[h] - 1;
+  return npos;
 }
 
-bool P4Info::local_find(const string &local_path, P4FileInfo &fi) const {
-  const filemap_type::const_iterator it = by_local.find(local_path);
+void P4PathIndex::insert(const table_type &table, size_t n) {
+  if(2 * (used + 1) > slots.size()) {
+    // Rehash into a table twice the size
+    vector<size_t> old(slots.size() ? 2 * slots.size() : 64, 0);
+    old.swap(slots);
+    used = 0;
+    for(size_t h = 0; h < old.size(); ++h)
+      if(old[h])
+        place(table, old[h] - 1);
+  }
+  place(table, n);
+}
+
+void P4PathIndex::place(const table_type &table, size_t n) {
+  const string &key = table[n].*field;
+  const size_t mask = slots.size() - 1;
+  size_t h = hash_path(key) & mask;
+  for(; slots[h]; h = (h + 1) & mask)
+    if(table[slots[h] - 1].*field == key)
+      break;
+  if(!slots[h])
+    ++used;
+  slots[h] = n + 1;
+}
 
-  if(it == by_local.end())
-    return false;
-  return depot_find(it->second, fi);
+void P4PathIndex::clear() {
+  slots.clear();
+  used = 0;
 }
 
-bool P4Info::relative_find(const string &relative_path, P4FileInfo &fi) const {
-  const filemap_type::const_iterator it = by_relative.find(relative_path);
+// P4Info ----------------------------------------------------------------------
 
-  if(it == by_relative.end())
-    return false;
-  return depot_find(it->second, fi);
+P4Info::P4Info(): by_depot(&P4FileInfo::depot_path),
+                  by_local(&P4FileInfo::local_path),
+                  by_relative(&P4FileInfo::relative_path),
+                  started(0), fetched(0), have_cached(false),
+                  use_fstat(getenv("VCS_P4_FSTAT") != NULL),
+                  fstat_groups(0) {
 }
 
-void P4Info::depot_list(list<string> &depot_paths) const {
-  depot_paths.clear();
-  for(info_type::const_iterator it = info.begin();
-      it != info.end();
-      ++it)
-    depot_paths.push_back(it->second.depot_path);
+P4Info::~P4Info() {
 }
 
-void P4Info::local_list(list<string> &local_paths) const {
-  local_paths.clear();
-  for(info_type::const_iterator it = info.begin();
-      it != info.end();
-      ++it)
-    local_paths.push_back(it->second.local_path);
+const P4FileInfo *P4Info::depot_find(const string &depot_path,
+                                     unsigned groups) const {
+  need(groups);
+  return lookup(depot_path);
 }
 
-void P4Info::relative_list(list<string> &relative_paths) const {
-  relative_paths.clear();
-  for(info_type::const_iterator it = info.begin();
-      it != info.end();
-      ++it)
-    relative_paths.push_back(it->second.relative_path);
+const P4FileInfo *P4Info::local_find(const string &local_path,
+                                     unsigned groups) const {
+  need(groups);
+  const size_t n = by_local.find(table, local_path);
+  return n == P4PathIndex::npos ? NULL : &table[n];
+}
+
+const P4FileInfo *P4Info::relative_find(const string &relative_path,
+                                        unsigned groups) const {
+  need(groups);
+  const size_t n = by_relative.find(table, relative_path);
+  return n == P4PathIndex::npos ? NULL : &table[n];
+}
+
+static bool lt_depot_path(const P4FileInfo *a, const P4FileInfo *b) {
+  return a->depot_path < b->depot_path;
+}
+
+void P4Info::all(vector<const P4FileInfo *> &files,
+                 unsigned groups) const {
+  need(groups);
+  files.clear();
+  files.reserve(table.size());
+  for(size_t n = 0; n < table.size(); ++n)
+    files.push_back(&table[n]);
+  sort(files.begin(), files.end(), lt_depot_path);
 }
 
 void P4Info::gather() {
-  vector<string> command, opened, errors, have;
-  int rc;
+  gather(vector<string>());
+}
 
-  info.clear();
+void P4Info::gather(const vector<string> &paths_) {
+  // Collect and discard anything still outstanding.  Groups that came from
+  // 'p4 fstat' have no command of their own.
+  const unsigned outstanding = started & ~fetched;
+  const unsigned separate = outstanding & ~fstat_groups;
+  if(separate & Opened)
+    opened.wait();
+  if((separate & Have) && have.running())
+    have.wait();                        // not started if the cache served
+  if(separate & Resolve)
+    resolve.wait();
+  if(separate & Changed)
+    revert.wait();
+  if(outstanding & fstat_groups)
+    fstat.wait();
+  opened_sink.results.clear();
+  have_sink.clear();
+  fstat_sink.clear();
+  have_cache.reset();
+  have_cached = false;
+  paths = paths_;
+  started = fetched = fstat_groups = 0;
+  table.clear();
+  by_depot.clear();
   by_local.clear();
   by_relative.clear();
+}
+
+// Build a p4 command line with the file patterns for PATHS, or for the
+// whole client if there are none
+static vector<string> &scoped(vector<string> &command,
+                              const vector<string> &paths) {
+  if(!paths.size()) {
+    command.push_back("...");
+    return command;
+  }
+  for(size_t n = 0; n < paths.size(); ++n) {
+    string pattern;
+    if(paths[n].compare(0, 2, "//") == 0)
+      pattern = paths[n];               // depot path, use as-is
+    else {
+      pattern = p4_encode(paths[n]);
+      if(pattern.size() && pattern.at(0) == '-')
+        pattern = "./" + pattern;
+    }
+    if(isdir(paths[n])) {
+      if(pattern.size() && pattern[pattern.size() - 1] != '/')
+        pattern += '/';
+      pattern += "...";
+    }
+    command.push_back(pattern);
+  }
+  return command;
+}
+
+void P4Info::want(unsigned groups) const {
+  vector<string> command;
+
+  // The queries are independent of one another, so they can all be in
+  // flight at once rather than paying for consecutive server round trips.
+  // Local has no query of its own; it is filled in from the others.
+  if(use_fstat
+     && (groups & (Opened|Have|Local|Resolve))
+     && !(started & (Opened|Have|Local|Resolve))) {
+    // One tagged query covers everything except the changed state.  Unless
+    // Have is wanted only open files are of interest.
+    makevs(command, "p4", "-ztag", "fstat", (char *)0);
+    fstat_groups = Opened|Local|Resolve;
+    if(groups & Have)
+      fstat_groups |= Have;
+    else
+      command.push_back("-Ro");
+    fstat_sink.clear();
+    fstat.start(scoped(command, paths), fstat_sink);
+    started |= fstat_groups;
+  }
+  groups &= ~(started | Local);
+  if(groups & Opened) {
+    opened_sink.results.clear();
+    opened.start(scoped(makevs(command, "p4", "opened", (char *)0), paths),
+                 opened_sink);
+  }
+  if(groups & Have) {
+    have_sink.clear();
+    if(!paths.size() && have_cache.usable()) {
+      // Only ask the server for the full list if there's no chance that the
+      // cached copy is current
+      have_cached = true;
+      have_cache.check();
+      if(!have_cache.exists())
+        have.start(makevs(command, "p4", "have", "...", (char *)0),
+                   have_sink, EXE_BIG);
+    } else {
+      have.start(scoped(makevs(command, "p4", "have", (char *)0), paths),
+                 have_sink, EXE_BIG);
+    }
+  }
+  if(groups & Resolve)
+    resolve.start(scoped(makevs(command, "p4", "resolve", "-n", (char *)0),
+                         paths));
+  if(groups & Changed)
+    revert.start(scoped(makevs(command, "p4", "revert", "-an", (char *)0),
+                        paths));
+  started |= groups;
+}
 
-  P4FileInfo::get(info, "...");
+void P4Info::need(unsigned groups) const {
+  // Resolve output is keyed by local path and only concerns open files;
+  // likewise revert output only concerns open files.
+  if(groups & Resolve)
+    groups |= Opened|Local;
+  if(groups & Changed)
+    groups |= Opened;
+  if(!(groups & ~fetched))
+    return;
+  want(groups & ~fetched);
+  if(groups & ~fetched & fstat_groups)
+    fetch_fstat();
+  if(groups & ~fetched & Opened)
+    fetch_opened();
+  if(groups & ~fetched & Have)
+    fetch_have();
+  // 'p4 where' on whatever is still missing a local path.  This waits for
+  // Opened and Have but not for Resolve or Changed, which may still be
+  // running.  (Fetching Opened may have turned up new files even if Local
+  // was complete before.)
+  if(groups & ~fetched & Local)
+    fetch_local();
+  if(groups & ~fetched & Resolve)
+    fetch_resolve();
+  if(groups & ~fetched & Changed)
+    fetch_changed();
+}
+
+// Find a file by depot path
+P4FileInfo *P4Info::lookup(const string &depot_path) const {
+  const size_t n = by_depot.find(table, depot_path);
+  return n == P4PathIndex::npos ? NULL : &table[n];
+}
+
+// Add a new file and return its row
+size_t P4Info::add(const P4FileInfo &fi) const {
+  const size_t n = table.size();
+  table.push_back(fi);
+  by_depot.insert(table, n);
+  if(fi.local_path.size()) {
+    table[n].local_path.clear();
+    set_local(n, fi.local_path);
+  }
+  return n;
+}
+
+// Record the local path of a file and derived indexes
+void P4Info::set_local(size_t n, const string &local_path) const {
+  P4FileInfo &fi = table[n];
+  fi.local_path = local_path;
+  by_local.insert(table, n);
+  fi.relative_path = get_relative_path(local_path);
+  by_relative.insert(table, n);
+}
+
+void P4Info::fetch_opened() const {
+  map<string,P4FileInfo> results;
+
+  P4FileInfo::get(results, opened, opened_sink);
+  fetched |= Opened;
+  for(map<string,P4FileInfo>::const_iterator it = results.begin();
+      it != results.end();
+      ++it) {
+    P4FileInfo *known = lookup(it->first);
+    if(!known) {
+      add(it->second);
+      // Newly discovered file, so its local path is not yet known
+      fetched &= ~Local;
+    } else {
+      // Already known from 'p4 have'; keep the local path
+      known->rev = it->second.rev;
+      known->action = it->second.action;
+      known->chnum = it->second.chnum;
+      known->type = it->second.type;
+      known->locked = it->second.locked;
+    }
+  }
+}
 
-  // 'p4 have' gives all files, in the form:
-  //   DEPOT-PATH#REV - LOCAL-PATH
-  if((rc = execute(makevs(command, "p4", "have", "...", (char *)0),
-                   NULL/*input*/,
-                   &have)))
+void P4Info::fetch_have() const {
+  vector<string> command;
+  int rc;
+
+  if(have_cached && !have.running()) {
+    LineBuffer cached(LineBuffer::large);
+    if(have_cache.fresh(cached)) {
+      fetched |= Have;
+      cached.finish();
+      merge_have(cached);
+      return;
+    }
+    have.start(makevs(command, "p4", "have", "...", (char *)0), have_sink,
+               EXE_BIG);
+  }
+  if((rc = have.wait())) {
+    report_lines(have.errors);
     fatal("'p4 have ...' exited with status %d", rc);
-  for(size_t n = 0; n < have.size(); ++n) {
-    const string &l = have[n];
-    string::size_type i = l.find('#');
-    const string depot_path = p4_decode(l.substr(0, i));
-    ++i;
-    string revs;
-    int rev;
-    try {
-      while(isdigit(l.at(i)))
-        revs += l[i++];
-      rev = atoi(revs.c_str());
-      while(l.at(i) == ' ' || l.at(i) == '-')
+  }
+  fetched |= Have;
+  if(!benign_errors(have.errors))
+    report_lines(have.errors);
+  have_sink.lines.finish();
+  if(have_cached)
+    have_cache.save(have_sink.lines);
+  merge_have(have_sink.lines);
+  have_sink.clear();
+}
+
+// 'p4 have' output is:
+//   //depot/path#REV - /local/path
+void P4Info::merge_have(const LineBuffer &lines) const {
+  size_t pos = 0;
+  LineSpan l;
+  while(lines.next(pos, l)) {
+    const size_t hash = l.find('#');
+    size_t i = hash;
+    int rev = 0;
+    if(hash != string::npos) {
+      while(++i < l.size() && isdigit((unsigned char)l[i]))
+        rev = 10 * rev + (l[i] - '0');
+      while(i < l.size() && (l[i] == ' ' || l[i] == '-'))
         ++i;
-    } catch(out_of_range &e) {
+    }
+    if(i >= l.size()) {
       fprintf(stderr, "ERROR: out of range in P4Info::gather '%s'\n",
-              l.c_str());
-      throw e;
+              l.str().c_str());
+      throw out_of_range("malformed 'p4 have' output");
     }
-    const string local_path = l.substr(i);
-    info_type::iterator it = info.find(depot_path);
-    if(it == info.end()) {
-      // Not an open file
+    const string depot_path = p4_decode(l.substr(0, hash).str());
+    const size_t row = by_depot.find(table, depot_path);
+    if(row == P4PathIndex::npos) {
+      // Not an open file (or opened isn't known yet)
       P4FileInfo fi;
       fi.depot_path = depot_path;
       fi.rev = rev;
-      fi.local_path = local_path;
-      info[fi.depot_path] = fi;
-      //fprintf(stderr, "have(1): %s -> %s\n", fi.depot_path.c_str(), fi.local_path.c_str());
+      fi.local_path = l.substr(i).str();
+      add(fi);
     } else {
       // Must be an open file.  Usefuly we can pick up the local path here.
-      it->second.local_path = local_path;
-      //fprintf(stderr, "have(2): %s -> %s\n", it->second.depot_path.c_str(), it->second.local_path.c_str());
+      set_local(row, l.substr(i).str());
     }
-    by_local[local_path] = depot_path;
   }
+}
 
+void P4Info::fetch_local() const {
   // We'll still be missing local paths for files known to 'opened' but not
   // 'have', e.g. those newly added.
+  fetched |= Local;
 
   // Accumulate a list of files we don't know the local path for
   list<string> files;
-  for(info_type::iterator it = info.begin();
-      it != info.end();
-      ++it)
-    if(it->second.local_path.size() == 0)
-      files.push_back(it->first);
+  for(size_t n = 0; n < table.size(); ++n)
+    if(table[n].local_path.size() == 0)
+      files.push_back(table[n].depot_path);
 
   if(files.size()) {
     // Use 'p4 where' to map depot paths to local paths
-    vector<string> where;
+    LineBuffer where;
+    size_t pos = 0;
+    LineSpan l;
     p4__where(where, files);
-    for(size_t n = 0; n < where.size(); ++n) {
-      const P4Where w(where[n]);
-      info[w.depot_path].local_path = w.local_path;
+    while(where.next(pos, l)) {
+      if(!l.size())
+        continue;
+      const P4Where w(l);
+      const size_t row = by_depot.find(table, w.depot_path);
+      if(row != P4PathIndex::npos)
+        set_local(row, w.local_path);
     }
   }
+}
 
-  // Fill in relative paths
-  for(info_type::iterator it = info.begin();
-      it != info.end();
-      ++it) {
-    it->second.relative_path = get_relative_path(it->second.local_path);
-    by_relative[it->second.relative_path] = it->first;
-  }
+void P4Info::fetch_resolve() const {
+  int rc;
 
   // Identify files needing 'p4 resolve'
-  vector<string> resolvable;
-  if((rc = execute(makevs(command, "p4", "resolve", "-n", "...", (char *)NULL),
-                   NULL/*input*/,
-                   &resolvable,
-                   &errors))) {
-    report_lines(errors);
+  if((rc = resolve.wait())) {
+    report_lines(resolve.errors);
     fatal("'p4 resolve -n ...' exited with status %d", rc);
   }
+  fetched |= Resolve;
   // output is /full/local/path - merging //source/depot/path#revno
-  for(size_t n = 0; n < resolvable.size(); ++n) {
-    const string &r = resolvable[n];
+  for(size_t n = 0; n < resolve.output.size(); ++n) {
+    const string &r = resolve.output[n];
     const string local_path = p4_decode(r.substr(0, r.find(' ')));
-    const string depot_path = by_local[local_path];
-    info[depot_path].resolvable = true;
+    const size_t row = by_local.find(table, local_path);
+    if(row != P4PathIndex::npos)
+      table[row].resolvable = true;
   }
+}
+
+void P4Info::fetch_changed() const {
+  int rc;
 
   // Identify files which have/haven't changed
-  vector<string> unchanged;
-  if((rc = execute(makevs(command, "p4", "revert", "-an", "...", (char *)NULL),
-                   NULL/*input*/,
-                   &unchanged,
-                   &errors))) {
-    report_lines(errors);
+  if((rc = revert.wait())) {
+    report_lines(revert.errors);
     fatal("'p4 revert -an ...' exited with status %d", rc);
   }
+  fetched |= Changed;
   // output is //DEPOT/PATH#REVNO - was ACTION, reverted
-  for(size_t n = 0; n < unchanged.size(); ++n) {
-    const string &u = unchanged[n];
+  for(size_t n = 0; n < revert.output.size(); ++n) {
+    const string &u = revert.output[n];
     const string depot_path = p4_decode(u.substr(0, u.find('#')));
-    info[depot_path].changed = false;
+    P4FileInfo *fi = lookup(depot_path);
+    if(fi)
+      fi->changed = false;
+  }
+}
+
+void P4Info::fetch_fstat() const {
+  int rc;
+
+  if((rc = fstat.wait())) {
+    report_lines(fstat.errors);
+    fatal("'p4 fstat ...' exited with status %d", rc);
+  }
+  fetched |= fstat_groups;
+  if(!benign_errors(fstat.errors))
+    report_lines(fstat.errors);
+  fstat_sink.finish();
+  for(size_t n = 0; n < fstat_sink.records.size(); ++n)
+    add_fstat(fstat_sink.records[n]);
+  fstat_sink.clear();
+}
+
+// Add the 'p4 fstat' record FI for a file on the client
+void P4Info::add_fstat(const P4FileInfo &fi) const {
+  const size_t row = by_depot.find(table, fi.depot_path);
+  if(row == P4PathIndex::npos)
+    add(fi);
+  else if(fi.action.size()) {
+    // Already known (from 'p4 opened' or 'p4 have') but now open
+    P4FileInfo &known = table[row];
+    const string local_path = known.local_path.size() ? known.local_path
+                                                      : fi.local_path;
+    const bool changed = known.changed;
+    known = fi;
+    known.changed = changed;
+    known.local_path.clear();
+    if(local_path.size())
+      set_local(row, local_path);
   }
+  // Otherwise merely had, and already known
 }
 
 // ltfilename ------------------------------------------------------------------
 
-// Split into path components.
-static void split_path(const string &path, vector<string> &bits) {
-  bits.clear();
-  string::size_type n = 0;
-  while(n < path.size()) {
-    if(path[n] == '/') {
-      ++n;
-    } else {
-      string::size_type slash = path.find('/', n);
-      bits.push_back(path.substr(n, slash - n));
-      n = slash;
+// Paths are compared a component at a time, in place, so that everything in
+// a directory sorts together.  Leading, trailing and repeated slashes are
+// ignored.  The order is the same as that of the strings key() returns, in
+// which each separator is a NUL that sorts before any other character.
+bool ltfilename::operator()(const string &a, const string &b) const {
+  const char *ap = a.data(), *const aend = ap + a.size();
+  const char *bp = b.data(), *const bend = bp + b.size();
+  for(;;) {
+    while(ap < aend && *ap == '/')
+      ++ap;
+    while(bp < bend && *bp == '/')
+      ++bp;
+    // If we've "run out" of both sides then they're equal
+    if(ap == aend && bp == bend)
+      return false;
+    // If we've only run out of one side then that side is smaller
+    if(ap == aend)
+      return true;
+    if(bp == bend)
+      return false;
+    // Compare the next component
+    while(ap < aend && bp < bend && *ap != '/' && *ap == *bp) {
+      ++ap;
+      ++bp;
     }
+    const bool adone = (ap == aend || *ap == '/');
+    const bool bdone = (bp == bend || *bp == '/');
+    if(adone && bdone)
+      continue;
+    // A component that is a prefix of the other is smaller
+    if(adone)
+      return true;
+    if(bdone)
+      return false;
+    return (unsigned char)*ap < (unsigned char)*bp;
   }
 }
 
-// Filename comparison should group files in the same directory together.  We
-// do this by finding the common prefix of A and B, then comparing the
-// immediately subsequent path component.
-bool ltfilename::operator()(const string &a, const string &b) const {
-  // Decompose into path components
-  vector<string> abits, bbits;
-  split_path(a, abits);
-  split_path(b, bbits);
-  // Find the common prefix length
-  size_t n;
-  for(n = 0; n < abits.size() && n < bbits.size() && abits[n] == bbits[n]; ++n)
-    ;
-  // If we've "run out" of both sides then they're equal
-  if(n == abits.size() && n == bbits.size())
-    return false;
-  // If we've only run out of one side then that side is smaller
-  if(n == abits.size())
-    return true;
-  if(n == bbits.size())
-    return false;
-  // Otherwise we compare the subsequent component
-  return abits[n] < bbits[n];
+// Slashes become a single NUL, which sorts before any other character
+string ltfilename::key(const string &path) {
+  string k;
+  k.reserve(path.size());
+  for(string::size_type n = 0; n < path.size(); ++n) {
+    if(path[n] != '/')
+      k += path[n];
+    else if(k.size() && k[k.size() - 1] != '\0'
+            && n + 1 < path.size() && path[n + 1] != '/')
+      k += '\0';
+  }
+  return k;
 }
 
 // P4Describe -----------------------------------------------------------------
 
-P4Describe::P4Describe(const char *change) {
-  int rc = capture(lines, "p4", "describe", "-du", change, (char *)0);
+static const char describe_diffs[] = "Differences ...";
+
+P4Describe::P4Describe(): differences(false) {
+}
+
+void P4Describe::describe(const char *change, const char *options) {
+  start(change, options);
+  wait();
+}
+
+void P4Describe::start(const char *change, const char *options) {
+  vector<string> command;
+  query.start(makevs(command, "p4", "describe", options, change,
+                     (char *)NULL),
+              *this);
+}
+
+void P4Describe::wait() {
+  const int rc = query.wait();
+  report_lines(query.errors);
   if(rc)
     fatal("p4 describe exited with status %d", rc);
   // TODO catch nonexistent changes
-  map<string, size_t> file_index;
-  for(size_t n = 0; n < lines.size(); ++n) {
-    const string &line = lines[n];
-    if(line.size() > 6 && line.compare(0, 6, "... //", 6) == 0) {
+  if(!differences)
+    output(describe_diffs);
+  // Files that got a diff section don't need anything further
+  vector<fileinfo> remaining;
+  for(size_t n = 0; n < files.size(); ++n)
+    if(!files[n].diffed)
+      remaining.push_back(files[n]);
+  files.swap(remaining);
+  file_index.clear();
+}
+
+void P4Describe::line(const string &line) {
+  if(!differences) {
+    if(line == describe_diffs)
+      differences = true;
+    else if(line.size() > 6 && line.compare(0, 6, "... //", 6) == 0) {
       // ... //depot/path/to/file#rev action
       fileinfo fi;
       const string::size_type hash = line.find('#');
@@ -557,16 +1004,22 @@ P4Describe::P4Describe(const char *change) {
       while(line.at(n) == ' ')
         ++n;
       fi.action.assign(line, n, line.size() - n);
-      file_index[fi.depot_path] = files.size();
-      files.push_back(fi);
-    }
-    if(line.size() > 5 && line.compare(0, 5, "==== ", 5) == 0) {
-      // ==== //depot/path/to/file#rev (type) ====
-      const string::size_type hash = line.find('#');
-      const string depot_path(line, 5, hash - 5);
-      files[file_index[depot_path]].line = n;
+      if(fi.action == "add" || fi.action == "branch"
+         || fi.action == "delete") {
+        file_index[fi.depot_path] = files.size();
+        files.push_back(fi);
+      }
     }
+  } else if(line.size() > 5 && line.compare(0, 5, "==== ", 5) == 0) {
+    // ==== //depot/path/to/file#rev (type) ====
+    const string::size_type hash = line.find('#');
+    const map<string, size_t>::const_iterator it
+      = file_index.find(string(line, 5, hash - 5));
+    // p4 has produced the diff; mark it as not needed
+    if(it != file_index.end())
+      files[it->second].diffed = true;
   }
+  output(line);
 }
 
 P4Describe::~P4Describe() {
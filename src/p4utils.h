@@ -26,11 +26,15 @@ struct P4Where {
 
   // Expects one line from 'p4 where'
   P4Where(const string &l) {
+    parse(LineSpan(l.data(), l.size()));
+  }
+
+  P4Where(const LineSpan &l) {
     parse(l);
   }
 
   // Expects one line from 'p4 where'
-  void parse(const string &l);
+  void parse(const LineSpan &l);
 };
 
 // Information about one file
@@ -59,61 +63,414 @@ struct P4FileInfo {
 
   static void get(map<string,P4FileInfo> &results,
                   const char *pattern);
+
+  // Collect the results of a 'p4 opened' already started in the background
+  // with output to SINK
+  static void get(map<string,P4FileInfo> &results,
+                  AsyncCommand &opened,
+                  class P4OpenedSink &sink);
+};
+
+// Parses 'p4 opened' output as it arrives
+class P4OpenedSink: public LineSink {
+public:
+  map<string,P4FileInfo> results;       // by depot path
+
+  void line(const string &l);
+};
+
+// Collects 'p4 have' output as it arrives.  It is parsed once complete,
+// straight from the buffer into P4Info's table, so a long list spills to
+// disk rather than being held in memory twice.
+class P4HaveSink: public LineSink {
+public:
+  P4HaveSink(): lines(LineBuffer::large) {}
+
+  LineBuffer lines;                     // raw lines
+
+  void line(const string &l);
+  void clear();
+};
+
+// Parses 'p4 -ztag fstat' output as it arrives.  Only records for files on
+// the client are kept.
+class P4FstatSink: public LineSink {
+public:
+  P4FstatSink();
+
+  vector<P4FileInfo> records;           // complete records
+
+  void line(const string &l);
+
+  // Complete the last record
+  void finish();
+
+  void clear();
+
+private:
+  P4FileInfo fi;                        // record being parsed
+  bool on_client;                       // true if fi is on the client
+};
+
+// On-disk cache of 'p4 have ...' output for the current client and
+// directory.  Only available if P4CLIENT and VCS_P4_HAVE_CACHE are set.
+class P4HaveCache {
+public:
+  P4HaveCache();
+  ~P4HaveCache();
+
+  // Return true if caching is possible at all
+  bool usable() const { return path.size() > 0; }
+
+  // Return true if there is a cache file, current or not
+  bool exists() const;
+
+  // Start the cheap server queries that identify the current sync state
+  void check();
+
+  // Return true and append the cached lines to LINES if the cache matches
+  // the current sync state
+  bool fresh(LineBuffer &lines);
+
+  // Record LINES as the have list for the current sync state
+  void save(const vector<string> &lines);
+
+  // Record raw 'p4 have' output as the have list for the current sync state
+  void save(const LineBuffer &lines);
+
+  // Apply the output of 'p4 sync ...' to the cache, if there is one
+  void update(const vector<string> &sync);
+
+  // Forget the sync state
+  void reset();
+
+private:
+  string path;                          // cache file, or empty
+  string key;                           // port, client and directory
+  string state;                         // current sync state, or empty
+  bool checked;                         // true if state is known
+  AsyncCommand latest, submitted, sizes; // state queries
+
+  void wait_check();
+  bool load(string &old_state, LineBuffer &lines) const;
+  void save(const vector<string> *lines, const LineBuffer *buffer);
+};
+
+// On-disk record of the local paths of files known to be open on the
+// current client, so that 'vcs edit' can avoid opening them again.  Only
+// available if P4CLIENT is set.  Entries are hints: a file that isn't
+// writable isn't open, whatever the cache says.
+class P4OpenedCache {
+public:
+  P4OpenedCache();
+
+  // Return true if PATH is recorded as open
+  bool contains(const string &path) const;
+
+  // Record PATHS as open
+  void add(const vector<string> &paths);
+
+  // Forget PATHS
+  void remove(const vector<string> &paths);
+
+  // Replace whatever is recorded in or below directory DIR with PATHS
+  void replace(const string &dir, const vector<string> &paths);
+
+  // Write back any changes
+  void save();
+
+  // Return the canonical form of PATH, relative to the current directory: the
+  // real path of its parent directory followed by its basename
+  static string canonical(const string &path);
+
+private:
+  string path;                          // cache file, or empty
+  string key;                           // port and client
+  set<string> opened;                   // local paths
+  bool dirty;                           // true if opened has changed
+};
+
+// The client's View, compiled so that listfiles() can skip directories that
+// can't contain any mapped files.  If P4CLIENT is set the compiled view is
+// cached on disk, so that the walk needn't wait for the server.
+class P4ClientView: public DirFilter {
+public:
+  P4ClientView();
+
+  // Start fetching the client spec and server case handling in the
+  // background
+  void start();
+
+  // Get a compiled view, from the cache if possible and otherwise by waiting
+  // for the client spec.  If anything about it is not understood then
+  // nothing will be pruned.
+  void load();
+
+  // Check a cached view against the server.  Returns false if the view has
+  // changed, in which case anything it pruned must be walked again.
+  bool confirm();
+
+  bool prune(const string &path) const;
+
+  // One mapping line, relative to the client root
+  struct rule {
+    bool exclude;                       // true for '-' lines
+    bool whole;                         // true if literal prefix then "..."
+    string prefix;                      // literal part before any wildcard
+  };
+
+  struct compiled {
+    string root;                        // client root
+    string case_handling;               // "sensitive", "insensitive" or ""
+    vector<rule> rules;                 // mapping lines in order
+  };
+
+private:
+  AsyncCommand spec, info;
+  compiled compiled_view;
+  const compiled *view;                 // compiled_view if usable, or NULL
+  bool cached;                          // true if view came from the cache
+  string base;                          // cwd relative to root, with '/'
+
+  bool compile();
+  void use();
+  bool load_cache();
+  void save_cache(const compiled *c) const;
 };
 
+// Order filenames with everything in a directory together
 struct ltfilename {
   bool operator()(const string &a, const string &b) const;
+
+  // Return a key for PATH such that plain comparison of keys orders paths as
+  // operator() does.  Cheaper when many paths are sorted.
+  static string key(const string &path);
+};
+
+// Hash index over one of the path fields of a table of P4FileInfo.  Only
+// row numbers are stored; the paths themselves live in the table.
+class P4PathIndex {
+public:
+  typedef vector<P4FileInfo> table_type;
+
+  P4PathIndex(string P4FileInfo::*field_);
+
+  // Return the row whose field is KEY, or npos
+  size_t find(const table_type &table, const string &key) const;
+
+  // Index row N under its current field value, replacing any other row with
+  // the same value
+  void insert(const table_type &table, size_t n);
+
+  void clear();
+
+  static const size_t npos = (size_t)-1;
+
+private:
+  string P4FileInfo::*field;            // field indexed
+  vector<size_t> slots;                 // row + 1, or 0 if empty
+  size_t used;                          // number of nonempty slots
+
+  void place(const table_type &table, size_t n);
 };
 
 // Collate information about files indexed in various ways
+//
+// Information is fetched in groups, each by its own query, and only when
+// first asked for.  Fields outside the groups asked for keep their default
+// values.
 class P4Info {
 public:
   P4Info();
   ~P4Info();
 
-  // Look up one file by various kinds of filename
-  bool depot_find(const string &depot_path, P4FileInfo &fi) const;
-  bool local_find(const string &local_path, P4FileInfo &fi) const;
-  bool relative_find(const string &relative_path, P4FileInfo &fi) const;
+  // Groups of fields
+  enum {
+    Opened = 1,                         // action, chnum, type, locked
+    Have = 2,                           // rev; adds files not opened
+    Local = 4,                          // local_path, relative_path
+    Resolve = 8,                        // resolvable
+    Changed = 16,                       // changed
+    Files = Opened|Have|Local,          // default for lookups
+  };
 
-  // Look up a list of known filenames of whichever kind
-  void depot_list(list<string> &depot_paths) const;
-  void local_list(list<string> &local_paths) const;
-  void relative_list(list<string> &relative_paths) const;
+  // Look up one file by various kinds of filename, returning NULL if it is
+  // not known.  The result remains valid until more groups are fetched or
+  // gather() is called.
+  const P4FileInfo *depot_find(const string &depot_path,
+                               unsigned groups = Files) const;
+  const P4FileInfo *local_find(const string &local_path,
+                               unsigned groups = Files) const;
+  const P4FileInfo *relative_find(const string &relative_path,
+                                  unsigned groups = Files) const;
 
-  // (Re-)gather information matching a given pattern
+  // Get all known files, ordered by depot path.  Validity is as above.
+  void all(vector<const P4FileInfo *> &files,
+           unsigned groups = Files) const;
+
+  // (Re-)target the whole client.  Nothing is fetched yet.
   void gather();
 
+  // (Re-)target just the named files and directories.  Nothing is fetched
+  // yet.
+  void gather(const vector<string> &paths);
+
+  // Start fetching GROUPS in the background, if not already started.  Use
+  // this to overlap several queries with each other or with other work.
+  void want(unsigned groups) const;
+
+  // Ensure that GROUPS have been fetched
+  void need(unsigned groups) const;
+
 private:
-  typedef map<string,P4FileInfo> info_type;
-  typedef map<string,string> filemap_type;
-  info_type info;                       // depot path -> information
-  filemap_type by_local;                // local path -> depot path
-  filemap_type by_relative;             // relative path -> depot path
+  vector<string> paths;                 // files of interest or empty
+  mutable P4PathIndex::table_type table; // all known files
+  mutable P4PathIndex by_depot;         // depot path -> row
+  mutable P4PathIndex by_local;         // local path -> row
+  mutable P4PathIndex by_relative;      // relative path -> row
+  mutable unsigned started;             // groups with queries started
+  mutable unsigned fetched;             // groups fetched
+
+  // Queries in progress, and parsers for those parsed as they arrive
+  mutable AsyncCommand opened, have, resolve, revert, fstat;
+  mutable P4OpenedSink opened_sink;
+  mutable P4HaveSink have_sink;
+  mutable P4FstatSink fstat_sink;
+
+  mutable P4HaveCache have_cache;
+  mutable bool have_cached;             // Have is coming via have_cache
+  bool use_fstat;                       // use 'p4 fstat' where possible
+  mutable unsigned fstat_groups;        // groups 'p4 fstat' is fetching
+
+  P4FileInfo *lookup(const string &depot_path) const;
+  size_t add(const P4FileInfo &fi) const;
+  void set_local(size_t n, const string &local_path) const;
+  void fetch_opened() const;
+  void fetch_have() const;
+  void merge_have(const LineBuffer &lines) const;
+  void fetch_local() const;
+  void fetch_resolve() const;
+  void fetch_changed() const;
+  void fetch_fstat() const;
+  void add_fstat(const P4FileInfo &fi) const;
+
+  P4Info(const P4Info &);
+  P4Info &operator=(const P4Info &);
 };
 
-// Output of 'p4 describe'
-struct P4Describe {
+// Streaming parser for 'p4 describe -du'.  Subclasses receive the output
+// through output() as it arrives.  Only the files that have no diff and
+// must be retrieved separately are remembered.
+class P4Describe: public LineSink {
 public:
-  P4Describe(const char *change);
-  ~P4Describe();
+  P4Describe();
+  virtual ~P4Describe();
 
   struct fileinfo {
-    fileinfo(): rev(0), line(0) {}
+    fileinfo(): rev(0), diffed(false) {}
     string depot_path;                  // depot path of a file
     int rev;                            // revision number in change
     string action;                      // action in change
-    size_t line;                        // line diffs found at, or 0
+    bool diffed;                        // true if p4 produced a diff
   };
 
-  vector<string> lines;                 // full text
-  vector<fileinfo> files;               // all files
+  // Describe CHANGE.  With "-s" for OPTIONS there are no diffs, so every
+  // added and deleted file is remembered.
+  void describe(const char *change, const char *options = "-du");
+
+  // Start describing CHANGE in the background.  Output is passed on as it
+  // arrives whenever anything waits.
+  void start(const char *change, const char *options = "-du");
+
+  // Wait for the description started by start()
+  void wait();
+
+  vector<fileinfo> files;               // added/deleted files without diffs
+
+protected:
+  // Called with each line of output
+  virtual void output(const string &l) = 0;
+
+private:
+  AsyncCommand query;                   // 'p4 describe'
+  bool differences;                     // true after "Differences ..."
+  map<string, size_t> file_index;       // depot path -> index into files
+
+  void line(const string &l);
+};
+
+// Told about files from P4Print::fetch() as they become available
+class P4PrintProgress {
+public:
+  virtual ~P4PrintProgress() {}
+
+  // Called when the first N files are complete and in the spool
+  virtual void printed(size_t n) = 0;
+};
+
+// Retrieve many files with a single 'p4 print'.  The contents are spooled to
+// a temporary file rather than held in memory.  The contents of binary files
+// are not kept at all.
+class P4Print: private ChunkSink, private LineSource, private LineSink {
+public:
+  P4Print();
+  ~P4Print();
+
+  struct file {
+    file(): rev(-1), found(false), offset(0), size(0) {}
+    string depot_path;                  // depot path (unencoded)
+    int rev;                            // revision wanted, or -1 for head
+    bool found;                         // true if p4 print produced it
+    string type;                        // file type
+    off_t offset;                       // start of contents in spool()
+    off_t size;                         // size of contents
+  };
+
+  // Add a file to retrieve and return its index
+  size_t add(const string &depot_path, int rev = -1);
+
+  // Retrieve all the files added so far.  Files that p4 can't print are
+  // reported and left not found.  If PROGRESS is not NULL it is told as
+  // files become available.
+  void fetch(P4PrintProgress *progress = NULL);
+
+  size_t size() const { return files.size(); }
+  const file &operator[](size_t n) const { return files[n]; }
+
+  // Path to file contents
+  const string &spool() const { return tmp.path(); }
+
+private:
+  vector<file> files;
+  TempFile tmp;
+
+  // Parse state during fetch()
+  FILE *fp;                             // spool
+  size_t expected;                      // next file to be printed
+  size_t next_error;                    // first file errors might be about
+  vector<bool> failed;                  // files p4 couldn't print
+  file *current;                        // file being received
+  string tail;                          // end of current line
+  off_t offset;                         // bytes of output so far
+  off_t start;                          // output offset of current line
+  off_t start_contents;                 // output offset of current file
+  off_t spooled;                        // bytes written to spool
+  size_t next_spec;                     // next file to ask for
+  P4PrintProgress *progress;            // told as files complete, or NULL
+
+  bool next(string &l);
+  void chunk(const char *ptr, size_t n);
+  void line(const string &l);
+  void check_header(off_t end, bool newline);
+
+  P4Print(const P4Print &);
+  P4Print &operator=(const P4Print &);
 };
 
 string p4_encode(const string &s);
 vector<string> p4_encode(const vector<string> &files);
 string p4_decode(const string &s);
-void p4__where(vector<string> &where, const list<string> &files);
+void p4__where(LineBuffer &where, const list<string> &files);
 void p4__where(const list<string> &files,
                map<string,P4Where> &depot,
                map<string,P4Where> &view,
@@ -0,0 +1,242 @@
+/*
+ * This file is part of VCS
+ * Copyright (C) 2026 Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "vcs.h"
+#include "p4utils.h"
+#include <stdexcept>
+#include <algorithm>
+#include <strings.h>
+
+// 'p4 client -o' looks like this:
+//
+//   Client:  NAME
+//   Root:    /local/path
+//   View:
+//           //depot/main/... //NAME/main/...
+//           -//depot/main/build/... //NAME/main/build/...
+//           "//depot/a b/..." "//NAME/a b/..."
+//
+// Only the client side of each mapping matters here.  A directory can be
+// pruned if the last mapping that could match anything below it excludes
+// all of it, or if no mapping could match anything below it at all.
+//
+// On a case-insensitive server mappings match names in any case.  If the
+// server's case handling isn't known then inclusions are matched in any case
+// and exclusions only exactly, so that the doubt never prunes anything.
+
+// Split a mapping line into its two (unquoted) paths
+static bool split_mapping(const string &l, string &lhs, string &rhs) {
+  string *const fields[] = { &lhs, &rhs };
+  string::size_type n = 0;
+  for(size_t f = 0; f < 2; ++f) {
+    string &s = *fields[f];
+    s.clear();
+    while(n < l.size() && isspace((unsigned char)l[n]))
+      ++n;
+    if(n < l.size() && (l[n] == '-' || l[n] == '+' || l[n] == '&')
+       && n + 1 < l.size() && l[n + 1] == '"')
+      s += l[n++];                      // -"//depot/..."
+    if(n < l.size() && l[n] == '"') {
+      const string::size_type q = l.find('"', n + 1);
+      if(q == string::npos)
+        return false;
+      s.append(l, n + 1, q - (n + 1));
+      n = q + 1;
+    } else {
+      while(n < l.size() && !isspace((unsigned char)l[n]))
+        s += l[n++];
+    }
+    if(!s.size())
+      return false;
+  }
+  return true;
+}
+
+// Return the value of a form field starting at POS
+static string field_value(const string &l, string::size_type pos) {
+  pos = l.find_first_not_of(" \t", pos);
+  return pos == string::npos ? string() : l.substr(pos);
+}
+
+// Compile the output of 'p4 client -o' and 'p4 -ztag info'.  Returns false
+// if it can't be used.
+static bool compile_view(const vector<string> &spec,
+                         const vector<string> &info,
+                         string &client,
+                         P4ClientView::compiled &view) {
+  size_t n = 0;
+  client.clear();
+  view.root.clear();
+  view.case_handling.clear();
+  view.rules.clear();
+  for(n = 0; n < info.size(); ++n)
+    if(info[n] == "... caseHandling sensitive"
+       || info[n] == "... caseHandling insensitive")
+      view.case_handling = info[n].substr(17);
+  for(n = 0; n < spec.size() && spec[n] != "View:"; ++n) {
+    const string &l = spec[n];
+    if(l.compare(0, 7, "Client:") == 0)
+      client = field_value(l, 7);
+    else if(l.compare(0, 5, "Root:") == 0)
+      view.root = field_value(l, 5);
+  }
+  if(!client.size() || !view.root.size() || view.root[0] != '/')
+    return false;
+  const string client_prefix = "//" + client + "/";
+  for(++n; n < spec.size() && spec[n].size()
+        && (spec[n][0] == '\t' || spec[n][0] == ' '); ++n) {
+    string lhs, rhs;
+    if(!split_mapping(spec[n], lhs, rhs))
+      return false;
+    P4ClientView::rule r;
+    r.exclude = (lhs[0] == '-');
+    if(rhs.compare(0, client_prefix.size(), client_prefix) != 0)
+      return false;
+    const string rest = rhs.substr(client_prefix.size());
+    const string::size_type wildcard = min(rest.find("..."),
+                                           min(rest.find('*'),
+                                               rest.find("%%")));
+    r.whole = (wildcard != string::npos
+               && rest.compare(wildcard, string::npos, "...") == 0);
+    try {
+      r.prefix = p4_decode(rest.substr(0, wildcard));
+    } catch(out_of_range &) {
+      return false;
+    }
+    view.rules.push_back(r);
+  }
+  return true;
+}
+
+// Return true if A and B prune the same directories
+static bool same_view(const P4ClientView::compiled &a,
+                      const P4ClientView::compiled &b) {
+  if(a.root != b.root
+     || a.case_handling != b.case_handling
+     || a.rules.size() != b.rules.size())
+    return false;
+  for(size_t n = 0; n < a.rules.size(); ++n)
+    if(a.rules[n].exclude != b.rules[n].exclude
+       || a.rules[n].whole != b.rules[n].whole
+       || a.rules[n].prefix != b.rules[n].prefix)
+      return false;
+  return true;
+}
+
+// Return true if S starts with PREFIX, ignoring case if FOLD is true
+static bool starts_with(const string &s, const string &prefix, bool fold) {
+  if(s.size() < prefix.size())
+    return false;
+  if(fold)
+    return strncasecmp(s.data(), prefix.data(), prefix.size()) == 0;
+  return s.compare(0, prefix.size(), prefix) == 0;
+}
+
+P4ClientView::P4ClientView(): view(NULL), cached(false) {
+}
+
+void P4ClientView::start() {
+  vector<string> command;
+  spec.start(makevs(command, "p4", "client", "-o", (char *)NULL));
+  info.start(makevs(command, "p4", "-ztag", "info", (char *)NULL));
+}
+
+// Wait for the server and compile what it said into compiled_view
+bool P4ClientView::compile() {
+  if(!spec.running())
+    return false;
+  const int rc = spec.wait();
+  if(info.running() && info.wait())
+    info.output.clear();                // case handling unknown
+  string client;
+  return !rc && compile_view(spec.output, info.output, client, compiled_view);
+}
+
+// Prune with compiled_view, if it applies to the current directory
+void P4ClientView::use() {
+  view = NULL;
+  // Paths given to prune() are relative to the current directory
+  const string here = cwd(), &root = compiled_view.root;
+  if(here == root)
+    base.clear();
+  else {
+    const string r = root[root.size() - 1] == '/' ? root : root + "/";
+    if(here.compare(0, r.size(), r) != 0)
+      return;                           // e.g. AltRoots; don't prune
+    base = here.substr(r.size()) + "/";
+  }
+  view = &compiled_view;
+}
+
+void P4ClientView::load() {
+  view = NULL;
+  cached = load_cache();
+  if(!cached) {
+    if(!compile())
+      return;                           // just don't prune
+    save_cache(&compiled_view);
+  }
+  use();
+}
+
+bool P4ClientView::confirm() {
+  if(!cached)
+    return true;
+  cached = false;
+  const compiled old = compiled_view;
+  if(!compile()) {
+    view = NULL;
+    save_cache(NULL);
+    return false;
+  }
+  if(same_view(old, compiled_view))
+    return true;
+  save_cache(&compiled_view);
+  use();
+  return false;
+}
+
+bool P4ClientView::prune(const string &path) const {
+  if(!view)
+    return false;
+  const string d = base + path + "/";
+  const bool fold_include = view->case_handling != "sensitive";
+  const bool fold_exclude = view->case_handling == "insensitive";
+  bool excluded = true;                 // unmapped unless a rule says not
+  for(size_t n = 0; n < view->rules.size(); ++n) {
+    const rule &r = view->rules[n];
+    const bool fold = r.exclude ? fold_exclude : fold_include;
+    if(r.whole && starts_with(d, r.prefix, fold))
+      // Covers everything below d
+      excluded = r.exclude;
+    else if(!r.exclude
+            && (starts_with(d, r.prefix, fold)
+                || starts_with(r.prefix, d, fold)))
+      // Might map something below d
+      excluded = false;
+  }
+  return excluded;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
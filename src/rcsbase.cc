@@ -156,12 +156,16 @@ int rcsbase::diff(const vector<string> &files) const {
   int rc = 0;
   if(native.size())
     rc = native_diff(native);
+  vector<Job> batch;
   for(size_t n = 0; n < added.size(); ++n)
-    rc |= execute("diff",
-                  EXE_STR, "-u",
-                  EXE_STR, "/dev/null",
-                  EXE_STRING|EXE_DOTSTUFF, &added[n],
-                  EXE_END);
+    add_job(batch, "", "diff",
+            EXE_STR, "-u",
+            EXE_STR, "/dev/null",
+            EXE_STRING|EXE_DOTSTUFF, &added[n],
+            EXE_END);
+  execute_many(batch, false);
+  for(size_t n = 0; n < batch.size(); ++n)
+    rc |= batch[n].status;
   return (rc & 2 ? 2 : rc);
 }
 
@@ -0,0 +1,135 @@
+/*
+ * This file is part of VCS
+ * Copyright (C) 2026 Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "vcs.h"
+#include "reactor.h"
+#include <poll.h>
+#include <unistd.h>
+#if HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+#if HAVE_DECL_SYS_PIDFD_OPEN
+# include <sys/syscall.h>
+#endif
+
+Reactor::Reactor(): epfd(-1) {
+#if HAVE_EPOLL_CREATE1
+  // If epoll is unavailable at runtime too, poll() will do
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+#endif
+}
+
+Reactor::~Reactor() {
+  if(epfd != -1)
+    close(epfd);
+}
+
+Reactor &Reactor::instance() {
+  static Reactor reactor;
+  return reactor;
+}
+
+void Reactor::add(int fd, unsigned events, EventHandler *handler) {
+  watch &w = watches[fd];
+  w.events = events;
+  w.handler = handler;
+#if HAVE_EPOLL_CREATE1
+  if(epfd != -1) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = (((events & Read) ? (uint32_t)EPOLLIN : 0)
+                 | ((events & Write) ? (uint32_t)EPOLLOUT : 0));
+    ev.data.fd = fd;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+      fatal("error calling epoll_ctl: %s", strerror(errno));
+  }
+#endif
+}
+
+void Reactor::remove(int fd) {
+  if(!watches.erase(fd))
+    return;
+#if HAVE_EPOLL_CREATE1
+  if(epfd != -1 && epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) < 0)
+    fatal("error calling epoll_ctl: %s", strerror(errno));
+#endif
+}
+
+bool Reactor::wait() {
+  if(!watches.size())
+    return false;
+  // Handlers may add or remove watches, so the ready descriptors are
+  // collected first and each looked up again before its handler is called
+  vector<int> ready;
+#if HAVE_EPOLL_CREATE1
+  if(epfd != -1) {
+    struct epoll_event events[64];
+    int n;
+    while((n = epoll_wait(epfd, events, 64, -1)) < 0) {
+      if(errno != EINTR)
+        fatal("error calling epoll_wait: %s", strerror(errno));
+    }
+    for(int i = 0; i < n; ++i)
+      ready.push_back(events[i].data.fd);
+  }
+#endif
+  if(epfd == -1) {
+    vector<struct pollfd> fds;
+    for(map<int,watch>::const_iterator it = watches.begin();
+        it != watches.end();
+        ++it) {
+      struct pollfd p;
+      p.fd = it->first;
+      p.events = (((it->second.events & Read) ? POLLIN : 0)
+                  | ((it->second.events & Write) ? POLLOUT : 0));
+      p.revents = 0;
+      fds.push_back(p);
+    }
+    while(poll(&fds[0], fds.size(), -1) < 0) {
+      if(errno != EINTR)
+        fatal("error calling poll: %s", strerror(errno));
+    }
+    for(size_t i = 0; i < fds.size(); ++i)
+      if(fds[i].revents)
+        ready.push_back(fds[i].fd);
+  }
+  for(size_t i = 0; i < ready.size(); ++i) {
+    map<int,watch>::const_iterator it = watches.find(ready[i]);
+    if(it != watches.end())
+      it->second.handler->ready();
+  }
+  return true;
+}
+
+int pid_fd(pid_t pid) {
+#if HAVE_DECL_SYS_PIDFD_OPEN
+  // Fails with ENOSYS before Linux 5.3
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  (void)pid;
+  return -1;
+#endif
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
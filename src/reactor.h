@@ -0,0 +1,84 @@
+/*
+ * This file is part of VCS
+ * Copyright (C) 2026 Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef REACTOR_H
+#define REACTOR_H
+
+// Something that wants to know when a file descriptor is ready
+class EventHandler {
+public:
+  virtual ~EventHandler() {}
+
+  // Called when the descriptor is ready (or has an error or hangup)
+  virtual void ready() = 0;
+};
+
+// Waits for file descriptors to become ready and calls their handlers.  Uses
+// epoll where available and poll() otherwise, so there is no limit on
+// descriptor numbers and handlers are registered once rather than on every
+// round.
+class Reactor {
+public:
+  Reactor();
+  ~Reactor();
+
+  enum {
+    Read = 1,
+    Write = 2,
+  };
+
+  // Watch FD for EVENTS, calling HANDLER when it is ready
+  void add(int fd, unsigned events, EventHandler *handler);
+
+  // Stop watching FD.  Must be called before FD is closed.
+  void remove(int fd);
+
+  // Wait until at least one descriptor is ready and call the handlers of
+  // all those that are.  Returns false if nothing is being watched.
+  bool wait();
+
+  // The reactor used for subprocess I/O
+  static Reactor &instance();
+
+private:
+  struct watch {
+    unsigned events;
+    EventHandler *handler;
+  };
+
+  int epfd;                             // epoll descriptor, or -1
+  map<int,watch> watches;               // fd -> what to do
+
+  Reactor(const Reactor &);
+  Reactor &operator=(const Reactor &);
+};
+
+// Return a descriptor that becomes readable when child PID exits, or -1 if
+// that isn't supported
+int pid_fd(pid_t pid);
+
+#endif /* REACTOR_H */
+
+/*
+Local Variables:
+mode:c++
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
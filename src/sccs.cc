@@ -65,54 +65,48 @@ public:
   }
 
   int native_commit(const vector<string> &files, const string &msg) const {
-    int rc = 0;
-    for(size_t n = 0; n < files.size() && !rc; ++n) {
-      InDirectory id(dirname_(files[n]));
-      string base = basename_(files[n]);
-      string option = "-y" + msg;
-      if(is_tracked(base)) {
-        rc = execute("sccs",
-                     EXE_STR, "delget",
-                     EXE_STRING, &option,
-                     EXE_STRING|EXE_DOTSTUFF, &base,
-                     EXE_END);
+    vector<Job> batch;
+    const string option = "-y" + msg;
+    for(size_t n = 0; n < files.size(); ++n) {
+      const string base = basename_(files[n]);
+      if(is_tracked(files[n])) {
+        add_job(batch, dirname_(files[n]), "sccs",
+                EXE_STR, "delget",
+                EXE_STRING, &option,
+                EXE_STRING|EXE_DOTSTUFF, &base,
+                EXE_END);
       } else {
         // TODO binary files
-        rc = execute("sccs",
-                     EXE_STR, "create",
-                     EXE_IFSTR(is_binary(base), "-b"),
-                     EXE_STRING, &option,
-                     EXE_STRING|EXE_DOTSTUFF, &base,
-                     EXE_END);
+        add_job(batch, dirname_(files[n]), "sccs",
+                EXE_STR, "create",
+                EXE_IFSTR(is_binary(files[n]), "-b"),
+                EXE_STRING, &option,
+                EXE_STRING|EXE_DOTSTUFF, &base,
+                EXE_END);
       }
     }
-    return rc;
+    return execute_many(batch);
   }
 
-  int native_revert(const vector<string> &files) const {
-    int rc = 0;
-    for(size_t n = 0; n < files.size() && !rc; ++n) {
-      InDirectory id(dirname_(files[n]));
-      string base = basename_(files[n]);
-      rc = execute("sccs",
-                   EXE_STR, "unedit",
-                   EXE_STRING|EXE_DOTSTUFF, &base,
-                   EXE_END);
+  // Run 'sccs COMMAND' on each of FILES, in its own directory
+  int each_file(const char *command, const vector<string> &files) const {
+    vector<Job> batch;
+    for(size_t n = 0; n < files.size(); ++n) {
+      const string base = basename_(files[n]);
+      add_job(batch, dirname_(files[n]), "sccs",
+              EXE_STR, command,
+              EXE_STRING|EXE_DOTSTUFF, &base,
+              EXE_END);
     }
-    return rc;
+    return execute_many(batch);
+  }
+
+  int native_revert(const vector<string> &files) const {
+    return each_file("unedit", files);
   }
 
   int native_update(const vector<string> &files) const {
-    int rc = 0;
-    for(size_t n = 0; n < files.size() && !rc; ++n) {
-      InDirectory id(dirname_(files[n]));
-      string base = basename_(files[n]);
-      rc = execute("sccs",
-                   EXE_STR, "get",
-                   EXE_STRING|EXE_DOTSTUFF, &base,
-                   EXE_END);
-    }
-    return rc;
+    return each_file("get", files);
   }
 
   int log(const string *path) const {
@@ -126,16 +120,7 @@ public:
   }
 
   int native_edit(const vector<string> &files) const {
-    int rc = 0;
-    for(size_t n = 0; n < files.size() && !rc; ++n) {
-      InDirectory id(dirname_(files[n]));
-      string base = basename_(files[n]);
-      rc = execute("sccs",
-                   EXE_STR, "edit",
-                   EXE_STRING|EXE_DOTSTUFF, &base,
-                   EXE_END);
-    }
-    return rc;
+    return each_file("edit", files);
   }
 };
 
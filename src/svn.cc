@@ -66,8 +66,10 @@ public:
     // Subversion's revert insist you tell it what files to revert.  So if
     // we want to revert everything we must cobble together a list.
     if(!files.size()) {
-      // Establish the current state
-      vector<string> status;
+      // Establish the current state.  On a large working copy this can be a
+      // lot of output, so allow it to spill to disk.
+      vector<string> command;
+      LineBuffer status(LineBuffer::large);
       int rc;
       // svn interactive output changes between versions.  Fortunately most
       // vaguely recent versions can produce XML output which hopefuly will be
@@ -109,7 +111,8 @@ public:
       //
       // See subversion/svn/status.c for the implementation.
       //
-      if((rc = capture(status, "svn", "status", "--xml", (char *)0)))
+      if((rc = execute(makevs(command, "svn", "status", "--xml", (char *)0),
+                       NULL, status)))
         fatal("svn status exited with status %d", rc);
       vector<string> files;
       const XMLNode *root = xmlparse(status, false);
@@ -146,27 +149,36 @@ public:
                      EXE_END);
   }
 
-  static bool status_compare(const string &a, const string &b) {
+  static bool status_compare(const LineSpan &a, const LineSpan &b) {
     if(a.size() > 8
-       && a.compare(1, 7, "       ") == 0
+       && a.has_at(1, "       ")
        && b.size() > 8
-       && b.compare(1, 7, "       ") == 0)
-      return a.compare(8, string::npos,
-                       b, 8, string::npos) < 0;
-    else
+       && b.has_at(1, "       ")) {
+      const int c = memcmp(a.ptr + 8, b.ptr + 8, min(a.len, b.len) - 8);
+      return c < 0 || (c == 0 && a.len < b.len);
+    } else
       return false;
   }
 
   int status() const {
-    // svn status output has unpredictable order in some versions, so sort it
-    vector<string> status;
+    // svn status output has unpredictable order in some versions, so sort it.
+    // Only the spans are moved around, not the lines themselves.
+    vector<string> command;
+    LineBuffer output;
     int rc;
-    if((rc = capture(status, "svn", "status", (char *)0)))
+    if((rc = execute(makevs(command, "svn", "status", (char *)0), NULL,
+                     output)))
       fatal("svn status exited with status %d", rc);
+    vector<LineSpan> status;
+    status.reserve(output.lines());
+    size_t pos = 0;
+    LineSpan l;
+    while(output.next(pos, l))
+      status.push_back(l);
     stable_sort(status.begin(), status.end(),
                 status_compare);
     for(size_t n = 0; n < status.size(); ++n)
-      writef(stdout, "stdout", "%s\n", status[n].c_str());
+      writef(stdout, "stdout", "%.*s\n", (int)status[n].len, status[n].ptr);
     return 0;
   }
 
@@ -38,6 +38,9 @@ int dryrun;
 // Preferred IP version
 int ipv;
 
+// Maximum number of commands to run at once, or 0 for the default
+int jobs;
+
 // Return nonzero if PATH is a directory.
 int isdir(const string &path,
           int links_count) {
@@ -337,6 +340,27 @@ string get_relative_path(const string &s) {
   return s;
 }
 
+// Return the directory to keep cached data in, creating it if necessary.
+// Returns an empty string if there is nowhere suitable.
+string cache_directory() {
+  string dir;
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  if(xdg && *xdg)
+    dir = xdg;
+  else {
+    const char *home = getenv("HOME");
+    if(!home || !*home)
+      return "";
+    dir = string(home) + PATHSEPSTR + ".cache";
+  }
+  if(mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST)
+    return "";
+  dir += PATHSEPSTR "vcs";
+  if(mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST)
+    return "";
+  return dir;
+}
+
 string tempfile() {
   // Pick a random filename
   string s;
@@ -137,22 +137,32 @@ const vcs *vcs::guess_branch(string uri) {
 }
 
 int vcs::rename(const vector<string> &sources, const string &destination) const {
+  vector<pair<string,string> > pairs;
+  rename_pairs(sources, destination, pairs);
+  for(size_t n = 0; n < pairs.size(); ++n)
+    rename_one(pairs[n].first, pairs[n].second);
+  return 0;
+}
+
+void vcs::rename_pairs(const vector<string> &sources,
+                       const string &destination,
+                       vector<pair<string,string> > &pairs) const {
+  pairs.clear();
   if(exists(destination)) {
     if(!isdir(destination))
       fatal("%s already exists (and is not a directory)", destination.c_str());
     // We're renaming files and/or directories "into" a directory
-    for(size_t n = 0; n < sources.size(); ++n) {
-      rename_one(sources[n],
-                 destination + "/" + basename_(sources[n]));
-    }
+    for(size_t n = 0; n < sources.size(); ++n)
+      pairs.push_back(pair<string,string>(sources[n],
+                                          destination + "/"
+                                          + basename_(sources[n])));
   } else {
     if(sources.size() != 1)
       fatal("Cannot rename multiple sources to (nonexistent) destination %s",
             destination.c_str());
     // We're just changing the name of one file or directory
-    rename_one(sources[0], destination);
+    pairs.push_back(pair<string,string>(sources[0], destination));
   }
-  return 0;
 }
 
 void vcs::rename_one(const string &, const string &) const {
@@ -66,6 +66,11 @@ public:
                      const string &destination) const;
 
   virtual void rename_one(const string &source, const string &destination) const;
+
+  // Work out the destination of each source, for rename()
+  void rename_pairs(const vector<string> &sources,
+                    const string &destination,
+                    vector<pair<string,string> > &pairs) const;
   virtual int show(const string &change) const; // optional for now
 
   static const vcs *guess();
@@ -140,6 +145,7 @@ extern int verbose;
 extern int dryrun;
 extern int ipv;
 extern int debug;
+extern int jobs;
 
 const string uri_scheme(const string &uri);
 int uri_exists(const string &uri);
@@ -160,6 +166,7 @@ void fatal(const char *msg, ...)
   attribute((format (printf, 1, 2)));
 int erase(const char *s);
 string tempfile();
+string cache_directory();
 
 #define EXE_END 0
 #define EXE_STR 1
@@ -172,6 +179,7 @@ string tempfile();
 #define EXE_SET 6
 #define EXE_VECTOR 7
 #define EXE_STRING 8
+#define EXE_INPUT 9                     // vector fed to stdin, one per line
 #define EXE_DOTSTUFF 16
 #define EXE_SVN 32
 #define EXE_OPT 64
@@ -192,10 +200,21 @@ void init_global_ignores();
 void read_ignores(list<string> &ignores, const string &path);
 int is_ignored(const list<string> &ignores,
                const string &file);
+
+// Decides which directories listfiles() need not descend into
+class DirFilter {
+public:
+  virtual ~DirFilter() {}
+
+  // Return true if nothing below directory PATH is of interest
+  virtual bool prune(const string &path) const = 0;
+};
+
 void listfiles(string path,
                list<string> &files,
                set<string> &ignored,
-               const string *followrcs = NULL);
+               const string *followrcs = NULL,
+               const DirFilter *filter = NULL);
 int version_compare(const string &a, const string &b);
 vector<string> remove_directories(const vector<string> &files);
 int execute(const vector<string> &command,
@@ -206,6 +225,213 @@ int execute(const vector<string> &command,
             unsigned flags = 0);
 void display_command(const vector<string> &vs);
 #define EXE_RAW 0x0001
+#define EXE_BIG 0x0002                  // expect a lot of output
+
+// Receives a command's output a line at a time, as it arrives
+class LineSink {
+public:
+  virtual ~LineSink() {}
+
+  // Called with each line.  The newline is removed unless EXE_RAW was used.
+  virtual void line(const string &l) = 0;
+};
+
+// Execute COMMAND passing its output to SINK.  Errors are captured as by
+// execute().
+int execute(const vector<string> &command,
+            LineSink &sink,
+            vector<string> *errors = NULL,
+            unsigned flags = 0);
+
+// Receives a command's output in blocks, as it arrives
+class ChunkSink {
+public:
+  virtual ~ChunkSink() {}
+
+  // Called with each block of output
+  virtual void chunk(const char *ptr, size_t n) = 0;
+};
+
+// Produces a command's input a line at a time, as the command reads it
+class LineSource {
+public:
+  virtual ~LineSource() {}
+
+  // Set L to the next line, without a newline, and return true, or return
+  // false if there are no more
+  virtual bool next(string &l) = 0;
+};
+
+// Execute COMMAND, feeding it INPUT if that is not NULL, and pass its output
+// to SINK.  Errors are captured as by execute().
+int execute(const vector<string> &command,
+            const vector<string> *input,
+            ChunkSink &sink,
+            vector<string> *errors = NULL);
+
+// Execute COMMAND, feeding it lines from INPUT, and pass its output to SINK
+// and its errors to ERRORS.  Errors written before a block of output reach
+// ERRORS before the block reaches SINK.
+int execute(const vector<string> &command,
+            LineSource &input,
+            ChunkSink &sink,
+            LineSink &errors);
+
+// A line of a LineBuffer, without its newline.  Only valid while the buffer
+// is unchanged.
+struct LineSpan {
+  LineSpan(): ptr(NULL), len(0) {}
+  LineSpan(const char *ptr_, size_t len_): ptr(ptr_), len(len_) {}
+
+  const char *ptr;
+  size_t len;
+
+  size_t size() const { return len; }
+  char operator[](size_t n) const { return ptr[n]; }
+  string str() const { return string(ptr, len); }
+
+  // Return the offset of the first C at or after POS, or string::npos
+  size_t find(char c, size_t pos = 0) const;
+
+  // Return the part from POS, of at most N bytes
+  LineSpan substr(size_t pos, size_t n = string::npos) const;
+
+  // Return true if S appears at POS
+  bool has_at(size_t pos, const char *s) const;
+};
+
+// Captured output held in a single buffer.  Lines are presented as spans
+// over it rather than each being copied out.
+//
+// If SPILL is nonzero then once more than SPILL bytes have been captured they
+// are moved to an unlinked temporary file, and further output is appended
+// there.  finish() maps the file into memory, so the pages can be dropped
+// and re-read as needed rather than occupying memory permanently.
+class LineBuffer {
+public:
+  explicit LineBuffer(size_t spill = 0);
+  ~LineBuffer();
+
+  // A SPILL for commands whose output may be enormous
+  static const size_t large = 16 << 20;
+
+  // Set LINE to the line starting at offset POS and advance POS to the start
+  // of the next.  Returns false if there are no more lines.
+  bool next(size_t &pos, LineSpan &line) const;
+
+  // Return the number of lines
+  size_t lines() const;
+
+  const char *data() const { return buffer; }
+  size_t size() const { return used; }
+  void clear();
+
+  // Return space to append at least N bytes, setting N to how much there
+  // actually is
+  char *space(size_t &n);
+
+  // Record that N bytes have been written to the space returned by space()
+  void commit(size_t n);
+
+  // Append N bytes from PTR
+  void append(const char *ptr, size_t n);
+
+  // Called when everything has been appended.  Until then the contents
+  // cannot be read back.
+  void finish();
+
+private:
+  char *buffer;                         // contents, or spill staging area
+  size_t used, capacity;
+  size_t spill;                         // limit before spilling, or 0
+  int fd;                               // spill file, or -1
+  size_t spilled;                       // bytes written to spill file
+  bool mapped;                          // true if buffer is a mapping
+
+  void flush();
+  void release();
+
+  LineBuffer(const LineBuffer &);
+  LineBuffer &operator=(const LineBuffer &);
+};
+
+// Execute COMMAND, feeding it INPUT if that is not NULL, and capture its
+// output in OUTPUT.  Errors are captured as by execute().
+int execute(const vector<string> &command,
+            const vector<string> *input,
+            LineBuffer &output,
+            vector<string> *errors = NULL);
+
+// Execute COMMAND, feeding it lines from INPUT, and capture its output in
+// OUTPUT.  Errors are captured as by execute().
+int execute(const vector<string> &command,
+            LineSource &input,
+            LineBuffer &output,
+            vector<string> *errors = NULL);
+
+// One command in a batch for execute_many()
+struct Job {
+  Job(): killfds(0), status(-1) {}
+  vector<string> command;               // command to run
+  string directory;                     // where to run it, or "" for here
+  unsigned killfds;                     // as set by EXE_NO_STDOUT etc
+  int status;                           // exit status, or -1 if not run
+};
+
+// Add a command, specified as for execute(), to BATCH.  It will be run in
+// DIRECTORY, or the current directory if that is empty.  EXE_INPUT is not
+// supported.
+void add_job(vector<Job> &batch, const string &directory,
+             const char *prog, ...);
+
+// Run the commands in BATCH, several at once (see jobs).  Each command's
+// output and errors are passed on together, in the order the commands are
+// listed.  If STOP is true then no more commands are started once one
+// fails.  Returns the status of the first command that failed, or 0.
+int execute_many(vector<Job> &batch, bool stop = true);
+
+// A command run in the background while other work (including other
+// commands) proceeds.  Output and errors are captured as by execute().
+class AsyncCommand: private LineSink {
+public:
+  AsyncCommand();
+  ~AsyncCommand();
+
+  // Start COMMAND.  FLAGS are as for execute().  If INPUT is not NULL then
+  // it is fed to the command's standard input; it must remain valid until
+  // wait() returns.
+  void start(const vector<string> &command, unsigned flags = 0,
+             const vector<string> *input = NULL);
+
+  // Start COMMAND, passing its output to SINK as it arrives (whenever
+  // anything waits) instead of collecting it in output
+  void start(const vector<string> &command, LineSink &sink,
+             unsigned flags = 0, const vector<string> *input = NULL);
+
+  // Wait for the command to complete, fill in output and errors and return
+  // its exit status
+  int wait();
+
+  // Return true if the command has been started but not waited for
+  bool running() const { return pid != -1; }
+
+  vector<string> output, errors;
+
+private:
+  vector<string> command;
+  unsigned flags;
+  pid_t pid;
+  LineSink *sink;                       // where output goes
+  class readfromfd *ro;
+  class readtostring *re;
+  class writefromlines *wi;
+
+  void line(const string &l);
+
+  AsyncCommand(const AsyncCommand &);
+  AsyncCommand &operator=(const AsyncCommand &);
+};
+
 vector<string> &makevs(vector<string> &command,
                        const char *prog,
                        ...);
@@ -222,6 +448,16 @@ int generic_rename(const vector<string> &sources, const char *destination,
 // like printf but throws and knows what file it's writing to
 int writef(FILE *fp, const char *what, const char *fmt, ...);
 
+// Write SIZE bytes of PATH from OFFSET (by default, all of it) to FP as a
+// unified diff hunk that adds (PREFIX '+') or removes (PREFIX '-') every
+// line.  WHAT names FP for error messages.  A final line with no newline is
+// counted in the hunk header and marked as such after it.
+void write_whole_diff(FILE *fp, const char *what, const string &path,
+                      char prefix, off_t offset = 0, off_t size = -1);
+
+// Return the number of newlines in the N bytes at PTR
+size_t count_newlines(const char *ptr, size_t n);
+
 extern list<string> global_ignores;
 
 #endif /* VCS_H */
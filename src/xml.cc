@@ -77,8 +77,18 @@ public:
   }
 
   void parse(const string &s) {
-    if(XML_Parse(expat, s.data(), s.size(), 0) != XML_STATUS_OK)
-      fatal("XML_Parse failed");
+    parse(s.data(), s.size());
+  }
+
+  void parse(const char *ptr, size_t n) {
+    // XML_Parse() takes an int length
+    while(n > 0) {
+      const size_t chunk = n < (1u << 30) ? n : (1u << 30);
+      if(XML_Parse(expat, ptr, chunk, 0) != XML_STATUS_OK)
+        fatal("XML_Parse failed");
+      ptr += chunk;
+      n -= chunk;
+    }
   }
 
   void done() {
@@ -203,6 +213,15 @@ XMLNode *xmlparse(const vector<string> &vs,
   return p.getRoot();
 }
 
+XMLNode *xmlparse(const LineBuffer &lb,
+                  bool want_character_data) {
+  Parser p(want_character_data);
+
+  p.parse(lb.data(), lb.size());
+  p.done();
+  return p.getRoot();
+}
+
 /*
 Local Variables:
 mode:c++
@@ -64,6 +64,8 @@ XMLNode *xmlparse(const string &s,
                   bool want_character_data = true);
 XMLNode *xmlparse(const vector<string> &vs,
                   bool want_character_data = true);
+XMLNode *xmlparse(const LineBuffer &lb,
+                  bool want_character_data = true);
 
 #endif /* XML_H */
 
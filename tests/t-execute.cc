@@ -30,6 +30,49 @@ static vector<string> makevs(const char *first, ...) {
   return vs;
 }
 
+// Collects lines as they arrive
+class Collect: public LineSink {
+public:
+  vector<string> lines;
+  void line(const string &l) {
+    lines.push_back(l);
+  }
+};
+
+// Generates numbered lines, with some empty ones
+class Count: public LineSource {
+public:
+  Count(size_t limit_): n(0), limit(limit_) {}
+
+  bool next(string &l) {
+    if(n >= limit)
+      return false;
+    l = (n % 7) ? string(n % 100, 'x') : string();
+    ++n;
+    return true;
+  }
+
+private:
+  size_t n, limit;
+};
+
+// Records output blocks, noting how many error lines preceded each
+class Blocks: public ChunkSink {
+public:
+  Blocks(const Collect &errors_): errors(errors_) {}
+
+  string data;
+  vector<size_t> seen;
+
+  void chunk(const char *ptr, size_t n) {
+    data.append(ptr, n);
+    seen.push_back(errors.lines.size());
+  }
+
+private:
+  const Collect &errors;
+};
+
 int main(int argc, char **) {
 
   if(argc > 1)
@@ -72,6 +115,205 @@ int main(int argc, char **) {
   assert(o.size() == 1);
   assert(o[0] == "wibble");
 
+  // Background commands run concurrently and can be collected in any order
+  AsyncCommand a, b;
+  a.start(makevs("sh", "-c", "echo foo; echo bar >&2", (char *)0));
+  b.start(makevs("sh", "-c", "exit 3", (char *)0));
+  assert(b.wait() == 3);
+  assert(b.output.size() == 0);
+  assert(a.wait() == 0);
+  assert(a.output.size() == 1);
+  assert(a.output[0] == "foo");
+  assert(a.errors.size() == 1);
+  assert(a.errors[0] == "bar");
+
+  // Output can be passed on line by line, including a final partial line
+  Collect c;
+  assert(execute(makevs("printf", "foo\\n\\nbar", (char *)0), c) == 0);
+  assert(c.lines.size() == 3);
+  assert(c.lines[0] == "foo");
+  assert(c.lines[1] == "");
+  assert(c.lines[2] == "bar");
+  Collect r;
+  assert(execute(makevs("printf", "foo\\nbar", (char *)0), r, NULL,
+                 EXE_RAW) == 0);
+  assert(r.lines.size() == 2);
+  assert(r.lines[0] == "foo\n");
+  assert(r.lines[1] == "bar");
+  Collect al;
+  AsyncCommand ac;
+  ac.start(makevs("printf", "one\\ntwo\\n", (char *)0), al);
+  assert(ac.wait() == 0);
+  assert(ac.output.size() == 0);
+  assert(al.lines.size() == 2);
+  assert(al.lines[0] == "one");
+  assert(al.lines[1] == "two");
+
+  // Many commands at once, each with all three pipes
+  const size_t ncommands = 60;
+  vector<AsyncCommand *> many;
+  vector<string> input = makevs("one", "two", (char *)0);
+  for(size_t n = 0; n < ncommands; ++n) {
+    char script[64];
+    snprintf(script, sizeof script, "cat; echo %zu; echo %zu >&2", n, n);
+    many.push_back(new AsyncCommand());
+    many.back()->start(makevs("sh", "-c", script, (char *)0), 0, &input);
+  }
+  for(size_t n = ncommands; n > 0; --n) {
+    AsyncCommand *const ac = many[n - 1];
+    assert(ac->wait() == 0);
+    assert(ac->output.size() == 3);
+    assert(ac->output[0] == "one");
+    assert(atoi(ac->output[2].c_str()) == (int)n - 1);
+    assert(ac->errors.size() == 1);
+    delete ac;
+  }
+
+  // Input and output much bigger than a pipe
+  vector<string> big;
+  for(size_t n = 0; n < 100000; ++n)
+    big.push_back("a line of input to be copied to the output");
+  assert(execute(makevs("cat", (char *)0), &big, &o, NULL) == 0);
+  assert(o == big);
+
+  // Output can be captured into a single buffer
+  LineBuffer lb;
+  LineSpan span;
+  size_t pos = 0, n;
+  assert(execute(makevs("printf", "foo\\n\\nbar baz", (char *)0), NULL, lb)
+         == 0);
+  assert(lb.lines() == 3);
+  assert(lb.next(pos, span) && span.str() == "foo");
+  assert(lb.next(pos, span) && span.size() == 0);
+  assert(lb.next(pos, span) && span.str() == "bar baz");
+  assert(span.find(' ') == 3 && span.find('x') == string::npos);
+  assert(span.has_at(4, "baz") && !span.has_at(5, "baz"));
+  assert(span.substr(4).str() == "baz" && span.substr(9).size() == 0);
+  assert(!lb.next(pos, span));
+  assert(execute(makevs("cat", (char *)0), &big, lb) == 0);
+  assert(lb.lines() == big.size());
+  for(pos = 0, n = 0; lb.next(pos, span); ++n)
+    assert(span.str() == big[n]);
+  assert(n == big.size());
+
+  // Input can be generated as it is needed
+  Count count(200000);
+  assert(execute(makevs("cat", (char *)0), count, lb) == 0);
+  assert(lb.lines() == 200000);
+  for(pos = 0, n = 0; lb.next(pos, span); ++n)
+    assert(span.str() == ((n % 7) ? string(n % 100, 'x') : string()));
+  assert(n == 200000);
+
+  // Errors written before some output are seen before it
+  Collect errs;
+  Blocks blocks(errs);
+  Count none(0);
+  assert(execute(makevs("sh", "-c", "echo bad >&2; echo good", (char *)0),
+                 none, blocks, errs) == 0);
+  assert(blocks.data == "good\n");
+  assert(blocks.seen.size() >= 1 && blocks.seen[0] == 1);
+  assert(errs.lines.size() == 1 && errs.lines[0] == "bad");
+
+  // Big output can go to disk instead
+  LineBuffer spilled(1000);
+  assert(execute(makevs("cat", (char *)0), &big, spilled) == 0);
+  assert(spilled.lines() == big.size());
+  for(pos = 0, n = 0; spilled.next(pos, span); ++n)
+    assert(span.str() == big[n]);
+  assert(n == big.size());
+  spilled.clear();
+  for(n = 0; n < 100; ++n)
+    spilled.append("0123456789abcdef\n", 17);
+  spilled.finish();
+  assert(spilled.size() == 1700 && spilled.lines() == 100);
+
+  // Output can go to a file, and output can be discarded
+  assert(execute(makevs("echo", "to file", (char *)0), NULL, NULL, NULL,
+                 ",execute.tmp") == 0);
+  FILE *fp = fopen(",execute.tmp", "r");
+  assert(fp);
+  string l;
+  assert(readline(",execute.tmp", fp, l) && l == "to file");
+  fclose(fp);
+  remove(",execute.tmp");
+  assert(execute("sh", EXE_STR, "-c", EXE_STR, "echo discarded",
+                 EXE_NO_STDOUT, EXE_END) == 0);
+
+  // A program that can't be run behaves as if it failed
+  assert(execute("/nonexistent/program", EXE_END) != 0);
+  AsyncCommand m;
+  m.start(makevs("/nonexistent/program", (char *)0));
+  assert(m.wait() != 0);
+  assert(m.output.size() == 0);
+
+  // Batches run in parallel but their output appears in order
+  jobs = 4;
+  vector<Job> batch;
+  add_job(batch, "", "sh", EXE_STR, "-c", EXE_STR, "sleep 1; echo one",
+          EXE_END);
+  add_job(batch, "/", "sh", EXE_STR, "-c", EXE_STR, "pwd", EXE_END);
+  add_job(batch, "", "sh", EXE_STR, "-c", EXE_STR, "echo three; exit 3",
+          EXE_END);
+  add_job(batch, "", "echo", EXE_STR, "four", EXE_END);
+  fflush(stdout);
+  const int saved = dup(1);
+  assert(freopen(",execute.tmp", "w", stdout));
+  const time_t started = time(NULL);
+  assert(execute_many(batch, false) == 3);
+  assert(time(NULL) - started < 3);
+  fflush(stdout);
+  dup2(saved, 1);
+  close(saved);
+  assert(batch[0].status == 0);
+  assert(batch[2].status == 3);
+  fp = fopen(",execute.tmp", "r");
+  assert(fp);
+  const char *const expect[] = { "one", "/", "three", "four" };
+  for(size_t n = 0; n < 4; ++n)
+    assert(readline(",execute.tmp", fp, l) && l == expect[n]);
+  assert(!readline(",execute.tmp", fp, l));
+  fclose(fp);
+  remove(",execute.tmp");
+
+  // Nothing more is started after a failure
+  batch.clear();
+  jobs = 1;
+  add_job(batch, "", "false", EXE_END);
+  add_job(batch, "", "true", EXE_END);
+  assert(execute_many(batch) == 1);
+  assert(batch[1].status == -1);
+
+  // ...even when several run at once, but those already running finish and
+  // their output still appears in order
+  batch.clear();
+  jobs = 2;
+  add_job(batch, "", "sh", EXE_STR, "-c", EXE_STR, "sleep 1; echo one",
+          EXE_END);
+  add_job(batch, "", "sh", EXE_STR, "-c", EXE_STR, "echo two; exit 5",
+          EXE_END);
+  add_job(batch, "", "sh", EXE_STR, "-c", EXE_STR, "echo > ,execute.3",
+          EXE_END);
+  add_job(batch, "", "sh", EXE_STR, "-c", EXE_STR, "echo > ,execute.4",
+          EXE_END);
+  fflush(stdout);
+  const int saved2 = dup(1);
+  assert(freopen(",execute.tmp", "w", stdout));
+  assert(execute_many(batch) == 5);
+  fflush(stdout);
+  dup2(saved2, 1);
+  close(saved2);
+  assert(batch[0].status == 0);
+  assert(batch[1].status == 5);
+  assert(batch[2].status == -1 && !exists(",execute.3"));
+  assert(batch[3].status == -1 && !exists(",execute.4"));
+  fp = fopen(",execute.tmp", "r");
+  assert(fp);
+  assert(readline(",execute.tmp", fp, l) && l == "one");
+  assert(readline(",execute.tmp", fp, l) && l == "two");
+  assert(!readline(",execute.tmp", fp, l));
+  fclose(fp);
+  remove(",execute.tmp");
+
   return 0;
 }
 
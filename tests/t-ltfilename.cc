@@ -36,6 +36,8 @@ static const char *const names[] = {
   "/b/c/a",
   "/z",
   "/zz",
+  "/zz/\xe9",
+  "/zz\xe9",
 };
 static const size_t nnames = sizeof names / sizeof *names;
 
@@ -70,6 +72,19 @@ int main(void) {
           exit(1);
         }
       }
+      // Sort keys must give the same order
+      {
+        const bool expect = (i < j);
+        const bool got = (ltfilename::key(names[i])
+                          < ltfilename::key(names[j]));
+        if(got != expect) {
+          fprintf(stderr, "key(%s) < key(%s): got %s but expected %s\n",
+                  names[i], names[j],
+                  bn[got], bn[expect]);
+          ++failed;
+          exit(1);
+        }
+      }
       // We don't compare and relative paths, we don't put the two together.
     }
   }
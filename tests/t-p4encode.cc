@@ -0,0 +1,163 @@
+/*
+ * This file is part of VCS
+ * Copyright (C) 2026 Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "vcs.h"
+#include "p4utils.h"
+#include <sstream>
+#include <iomanip>
+#include <sys/time.h>
+
+// The original implementations, for comparison
+
+static string ref_encode(const string &s) {
+  ostringstream r;
+  r << hex;
+  for(string::size_type n = 0; n < s.size(); ++n)
+    switch(s[n]) {
+    case '@':
+    case '#':
+    case '*':
+    case '%':
+      r << "%" << setw(2) << setfill('0') << (int)s[n];
+      break;
+    default:
+      r << s[n];
+      break;
+    }
+  return r.str();
+}
+
+static int fromhex(int c) {
+  if(c >= '0' && c <= '9')
+    return c - '0';
+  if(c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return 0;
+}
+
+static string ref_decode(const string &s) {
+  string r;
+  for(string::size_type n = 0; n < s.size(); ++n) {
+    if(s[n] == '%') {
+      r += 16 * fromhex(s.at(n + 1)) + fromhex(s.at(n + 2));
+      n += 2;
+    } else
+      r += s[n];
+  }
+  return r;
+}
+
+static const char *const cases[] = {
+  "",
+  "a",
+  "//depot/main/src/file.c",
+  "@",
+  "#%*@",
+  "//depot/dir@1/file#2.c",
+  "//depot/a*b/c%d",
+  "1234567@",
+  "12345678@",
+  "123456789@",
+  "%%%%%%%%%%%%%%%%",
+  "//depot/\xe9\xff/\x80",
+};
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Time encoding and decoding a million paths, old and new
+static void benchmark(double fraction) {
+  vector<string> paths, encoded;
+  for(size_t n = 0; n < 1000000; ++n) {
+    ostringstream s;
+    s << "//depot/project/branch/src/module" << n % 97
+      << "/subdir" << n % 13 << "/file" << n;
+    if(n < fraction * 1000000)
+      s << "@x";
+    s << ".cc";
+    paths.push_back(s.str());
+  }
+  size_t total = 0;
+  double t = now();
+  for(size_t n = 0; n < paths.size(); ++n)
+    total += ref_encode(paths[n]).size();
+  const double ref_enc = now() - t;
+  t = now();
+  for(size_t n = 0; n < paths.size(); ++n)
+    encoded.push_back(p4_encode(paths[n]));
+  const double new_enc = now() - t;
+  t = now();
+  for(size_t n = 0; n < encoded.size(); ++n)
+    total += ref_decode(encoded[n]).size();
+  const double ref_dec = now() - t;
+  t = now();
+  for(size_t n = 0; n < encoded.size(); ++n)
+    total += p4_decode(encoded[n]).size();
+  const double new_dec = now() - t;
+  printf("%.0f%% escaped: encode %.3fs -> %.3fs, decode %.3fs -> %.3fs"
+         " (%zu)\n",
+         fraction * 100, ref_enc, new_enc, ref_dec, new_dec, total);
+}
+
+int main(int argc, char **) {
+  for(size_t n = 0; n < sizeof cases / sizeof *cases; ++n) {
+    const string s = cases[n];
+    assert(p4_encode(s) == ref_encode(s));
+    assert(p4_decode(p4_encode(s)) == s);
+    assert(p4_decode(ref_encode(s)) == ref_decode(ref_encode(s)));
+  }
+  // Every byte value, at every alignment
+  string all;
+  for(int c = 1; c < 256; ++c)
+    all += (char)c;
+  for(size_t n = 0; n < 16; ++n) {
+    const string s = all.substr(n);
+    assert(p4_encode(s) == ref_encode(s));
+    assert(p4_decode(p4_encode(s)) == s);
+  }
+  // Either case of hex digit is accepted
+  assert(p4_decode("%40%2A%2a%25x%03") == "@**%x\x03");
+  // Truncated escapes are an error
+  bool threw = false;
+  try {
+    p4_decode("abc%4");
+  } catch(out_of_range &) {
+    threw = true;
+  }
+  assert(threw);
+  if(argc > 1) {
+    benchmark(0);
+    benchmark(0.1);
+    benchmark(1);
+  }
+  return 0;
+}
+
+/*
+Local Variables:
+mode:c++
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,82 @@
+/*
+ * This file is part of VCS
+ * Copyright (C) 2026 Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "vcs.h"
+#include "p4utils.h"
+
+// A stand-in for p4 that is slow enough for its queries still to be
+// running when gather() is called again
+static const char stub[] =
+  "#! /bin/sh\n"
+  "sleep 1\n"
+  "case \"$*\" in\n"
+  "have* ) echo '//depot/a#1 - '\"$PWD\"'/a' ;;\n"
+  "changes* ) echo 'Change 1 on 2026/01/01 by u@c' ;;\n"
+  "sizes* ) echo '... 1 files 2 bytes' ;;\n"
+  "esac\n";
+
+int main() {
+  assert(execute("rm", EXE_STR, "-rf", EXE_STR, ",p4info", EXE_END) == 0);
+  assert(execute("mkdir", EXE_STR, ",p4info", EXE_END) == 0);
+  FILE *fp = fopen(",p4info/p4", "w");
+  assert(fp);
+  assert(fputs(stub, fp) >= 0);
+  assert(fclose(fp) >= 0);
+  assert(chmod(",p4info/p4", 0755) == 0);
+  const string path = cwd() + "/,p4info:" + getenv("PATH");
+  setenv("PATH", path.c_str(), 1);
+
+  // With 'p4 fstat' in use, opened, have and resolve have no command of
+  // their own, so there is nothing to wait for but fstat
+  setenv("VCS_P4_FSTAT", "1", 1);
+  {
+    P4Info info;
+    info.gather();
+    info.want(P4Info::Files|P4Info::Resolve|P4Info::Changed);
+    info.gather();
+  }
+  unsetenv("VCS_P4_FSTAT");
+
+  // The first query fills the have cache; the second finds it and starts no
+  // 'p4 have', so there is only the freshness check to wait for
+  const string cache = cwd() + "/,p4info";
+  setenv("XDG_CACHE_HOME", cache.c_str(), 1);
+  setenv("P4CLIENT", "t-p4info", 1);
+  setenv("VCS_P4_HAVE_CACHE", "1", 1);
+  {
+    P4Info info;
+    info.gather();
+    assert(info.depot_find("//depot/a", P4Info::Have));
+    info.gather();
+    info.want(P4Info::Have);
+    info.gather();
+    info.want(P4Info::Have);
+    assert(info.depot_find("//depot/a", P4Info::Have));
+  }
+
+  assert(execute("rm", EXE_STR, "-rf", EXE_STR, ",p4info", EXE_END) == 0);
+  return 0;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,141 @@
+/*
+ * This file is part of VCS
+ * Copyright (C) 2026 Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "vcs.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// What write_whole_diff() should produce for CONTENTS
+static string expected(const string &contents, char prefix) {
+  size_t lines = 0;
+  string body;
+  bool start = true;
+  for(size_t n = 0; n < contents.size(); ++n) {
+    if(start) {
+      body += prefix;
+      ++lines;
+    }
+    body += contents[n];
+    start = (contents[n] == '\n');
+  }
+  char header[64];
+  snprintf(header, sizeof header,
+           prefix == '+' ? "@@ -0,0 +1,%zu @@\n" : "@@ -1,%zu +0,0 @@\n",
+           lines);
+  if(!start)
+    body += "\n\\ No newline at end of file\n";
+  return header + body;
+}
+
+static void put(const char *path, const string &contents) {
+  FILE *fp = fopen(path, "w");
+  assert(fp);
+  assert(fwrite(contents.data(), 1, contents.size(), fp) == contents.size());
+  assert(fclose(fp) == 0);
+}
+
+// Run write_whole_diff() and return what it wrote
+static string run(const char *path, char prefix,
+                  off_t offset = 0, off_t size = -1) {
+  FILE *fp = tmpfile();
+  assert(fp);
+  write_whole_diff(fp, "output", path, prefix, offset, size);
+  assert(fflush(fp) == 0);
+  rewind(fp);
+  string r;
+  int c;
+  while((c = getc(fp)) != EOF)
+    r += c;
+  fclose(fp);
+  return r;
+}
+
+static void check(const string &contents) {
+  put(",whole.tmp", contents);
+  assert(run(",whole.tmp", '+') == expected(contents, '+'));
+  assert(run(",whole.tmp", '-') == expected(contents, '-'));
+}
+
+// Check write_whole_diff() on a pipe that CONTENTS are written into
+static void check_fifo(const string &contents) {
+  remove(",whole.fifo");
+  assert(mkfifo(",whole.fifo", 0600) == 0);
+  const pid_t pid = fork();
+  assert(pid >= 0);
+  if(pid == 0) {
+    put(",whole.fifo", contents);
+    _exit(0);
+  }
+  assert(run(",whole.fifo", '+') == expected(contents, '+'));
+  int w;
+  assert(waitpid(pid, &w, 0) == pid && w == 0);
+}
+
+int main(void) {
+  // Newline counting, every alignment and some near misses
+  string bytes;
+  for(size_t n = 0; n < 300; ++n)
+    bytes += "\n\x8a\x0b\x09\n\n\xff"[n % 7];
+  for(size_t start = 0; start < 16; ++start)
+    for(size_t len = 0; start + len < bytes.size(); len += 7) {
+      size_t count = 0;
+      for(size_t n = start; n < start + len; ++n)
+        count += (bytes[n] == '\n');
+      assert(count_newlines(bytes.data() + start, len) == count);
+    }
+
+  check("");
+  check("a\n");
+  check("a");
+  check("a\nb");
+  check("\n\n\n");
+  string big;
+  for(size_t n = 0; n < 100000; ++n)
+    big += "line " + string(n % 40, 'x') + "\n";
+  check(big);
+  check(big + "tail");
+
+  // Part of a file, at an offset that isn't page-aligned
+  put(",whole.tmp", "header\n" + big + "trailer\n");
+  assert(run(",whole.tmp", '-', 7, big.size()) == expected(big, '-'));
+
+  // A missing final newline is still counted as a line
+  put(",whole.tmp", "a\nb");
+  assert(run(",whole.tmp", '+')
+         == "@@ -0,0 +1,2 @@\n+a\n+b\n\\ No newline at end of file\n");
+
+  // Something that isn't a regular file, both small enough to keep in memory
+  // and too big to
+  check_fifo("a\nb");
+  check_fifo(big + "tail");
+
+  remove(",whole.tmp");
+  remove(",whole.fifo");
+  return 0;
+}
+
+/*
+Local Variables:
+mode:c++
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/